@@ -5,6 +5,20 @@ local settings = {
     ["movespeed"] = 20,
     ["infinite_scrolling"] = 1,
     ["use_fast_renderer"] = 1,
+    ["chunk_cache_mb"] = 256,
+    ["map_resident_mb"] = 64,
+    ["texture_cache_mb"] = 128,
+    ["zoom_step"] = 2,
+    ["target_fps"] = 60,
+    ["sim_steps_per_second"] = 0,
+    ["idle_timeout_ms"] = 500,
+    ["max_frames_in_flight"] = 0,
+    ["stream_mapgen"] = 0,
+    ["headless"] = 0,
+    ["dump_frames"] = "",
+    ["max_frames"] = 0,
+    ["record_input"] = "",
+    ["replay_input"] = "",
     ["keys"] = {
         ["moveup"] = "Up",
         ["movedown"] = "Down",
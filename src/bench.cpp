@@ -0,0 +1,355 @@
+#define SDL_MAIN_HANDLED
+#include "engine/engine.h"
+#include "engine/screen.h"
+#include "engine/tilemap.h"
+#include "engine/texture.h"
+#include "engine/sim.h"
+#include "engine/db.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+// Repeatable performance scenarios, run from the repository root:
+// engine_bench [--frames N] [--out results.json]
+
+// counts the allocations of each scenario, gcc takes the malloc/free pairs for mismatched new/delete
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static std::atomic<long long> num_allocs(0);
+static std::atomic<long long> alloc_bytes(0);
+
+void* operator new(size_t n) {
+    num_allocs.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+    void* p = malloc(n ? n : 1);
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+void* operator new[](size_t n) { return operator new(n); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+struct Result {
+    std::string name;
+    std::vector<double> times; // microseconds per iteration
+    long long allocs = 0;
+    long long bytes = 0;
+};
+
+static std::vector<Result> results;
+
+// runs setup untimed before every iteration, the first iterations only warm up caches
+static void measure(const std::string& name, int iterations, int warmup, const std::function<void()>& f, const std::function<void()>& setup = nullptr) {
+    fprintf(stderr, "%s\n", name.c_str());
+    Result r;
+    r.name = name;
+    for (int i = 0; i < warmup + iterations; i++) {
+        if (setup) {
+            setup();
+        }
+        long long allocs = num_allocs;
+        long long bytes = alloc_bytes;
+        long long t = now();
+        f();
+        t = now() - t;
+        if (i >= warmup) {
+            r.times.push_back(t);
+            r.allocs += num_allocs - allocs;
+            r.bytes += alloc_bytes - bytes;
+        }
+    }
+    results.push_back(r);
+}
+
+static void write_json(FILE* file) {
+    fprintf(file, "{\n  \"simd\": \"%s\",\n  \"resolution\": [%d, %d],\n  \"scenarios\": [", simd_level().c_str(), Engine.screen()->get_size().w, Engine.screen()->get_size().h);
+    for (size_t i = 0; i < results.size(); i++) {
+        Result& r = results[i];
+        std::vector<double> t = r.times;
+        std::sort(t.begin(), t.end());
+        const int n = t.size();
+        auto at = [&](double p) { return t[std::min<int>(n - 1, p * n)]; };
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"iterations\": %d, \"min_us\": %.1f, \"median_us\": %.1f, \"p99_us\": %.1f, \"allocs_per_iteration\": %.1f, \"alloc_bytes_per_iteration\": %.1f}",
+            i ? "," : "", r.name.c_str(), n, t[0], at(0.5), at(0.99), (double)r.allocs / n, (double)r.bytes / n);
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+static void set_map_size(Size map_size) {
+    auto& settings = Engine.config("settings");
+    std::map<ScriptParam, ScriptParam> mapsize;
+    mapsize["width"] = map_size.w;
+    mapsize["height"] = map_size.h;
+    settings.set("mapsize", mapsize);
+    Engine.db()->remove_matrix("tiles");
+    Engine.map()->create_map(Engine.screen()->get_size());
+}
+
+static void bench_render(int frames) {
+    auto& settings = Engine.config("settings");
+    for (int infinite : {0, 1}) {
+        settings.set("infinite_scrolling", infinite);
+        Engine.map()->create_map(Engine.screen()->get_size());
+        for (int level = 5; level >= -2; level--) {
+            const float zoom = level >= 0 ? Texture::idx2zoom(level) : Texture::idx2zoom(0) / (1 << -level);
+            Engine.map()->set_zoom(zoom);
+            Engine.map()->move_cam_to_tile({0, 0});
+            char name[64];
+            snprintf(name, sizeof(name), "render_zoom_%g_%s", zoom, infinite ? "infinite" : "bounded");
+            measure(name, frames, 10, [&]() {
+                Engine.map()->move_cam({10, 10});
+                Engine.screen()->draw();
+                Engine.textures()->trim();
+            });
+        }
+    }
+}
+
+static void bench_mapgen() {
+    for (int map_size : {1024, 4096}) {
+        set_map_size({map_size, map_size});
+        measure("mapgen_" + std::to_string(map_size), map_size > 1024 ? 3 : 10, 1, []() { Engine.map()->randomize_map(); });
+    }
+    // streamed maps start drawing while their chunks are still generated
+    auto& settings = Engine.config("settings");
+    settings.set("stream_mapgen", 1);
+    for (int map_size : {1024, 4096}) {
+        set_map_size({map_size, map_size});
+        measure("mapgen_stream_" + std::to_string(map_size), 10, 1, []() {
+            Engine.map()->randomize_map();
+            Engine.map()->move_cam_to_tile({0, 0});
+            Engine.screen()->draw();
+        }, []() { Engine.map()->finish_map(); });
+    }
+    Engine.map()->finish_map();
+    settings.set("stream_mapgen", 0);
+}
+
+static void bench_database() {
+    measure("db_write", 10, 1, []() { Engine.db()->write("bench.sav"); });
+    measure("db_read", 10, 1, []() { Engine.db()->read("bench.sav"); }, []() { Engine.db()->write("bench.sav"); });
+    // the tables are untyped after reading, like in GameEngine::load_state
+    Engine.textures()->reinit();
+    Engine.map()->create_map(Engine.map()->get_size());
+    std::remove("bench.sav");
+
+    // while a snapshot is open, reading the map copies no pages and writing a tile copies one
+    Snapshot* snapshot = Engine.db()->snapshot();
+    const Size map_size = Engine.map()->tilemap_size();
+    measure("snapshot_reads", 10, 1, [&]() {
+        int sum = 0;
+        for (short y = 0; y < map_size.h; y++) {
+            for (short x = 0; x < map_size.w; x++) {
+                sum += Engine.map()->get_ground(Point(x, y));
+            }
+        }
+        Engine.sim()->simtime();
+        volatile int keep = sum;
+        (void)keep;
+    });
+    const int read_pages = snapshot->copied_pages();
+    Engine.map()->set_ground(Engine.map()->get_ground(Point(0, 0)), Point(0, 0), false);
+    const int written_pages = snapshot->copied_pages();
+    Engine.db()->release(snapshot);
+    if (read_pages != 0 || written_pages != 1) {
+        fprintf(stderr, "snapshot copied %d pages for reads and %d for one write\n", read_pages, written_pages);
+        exit(1);
+    }
+}
+
+// the zoom levels drawn from the chunk cache, with and without it
+static void bench_chunk_cache(int frames) {
+    auto& settings = Engine.config("settings");
+    const int cache_mb = settings["chunk_cache_mb"].i();
+    settings.set("chunk_cache_mb", std::max(1, cache_mb));
+    Engine.map()->create_map(Engine.screen()->get_size());
+    std::vector<float> zooms;
+    for (int level = 5; level >= 0; level--) {
+        Engine.map()->set_zoom(Texture::idx2zoom(level));
+        if (Engine.map()->chunk_cached()) {
+            zooms.push_back(Texture::idx2zoom(level));
+        }
+    }
+    for (int cached : {1, 0}) {
+        settings.set("chunk_cache_mb", cached ? std::max(1, cache_mb) : 0);
+        Engine.map()->create_map(Engine.screen()->get_size());
+        for (float zoom : zooms) {
+            Engine.map()->set_zoom(zoom);
+            Engine.map()->move_cam_to_tile({0, 0});
+            char name[64];
+            snprintf(name, sizeof(name), "render_chunks_zoom_%g_%s", zoom, cached ? "cached" : "uncached");
+            measure(name, frames, 10, [&]() {
+                Engine.map()->move_cam({10, 10});
+                Engine.screen()->draw();
+                Engine.textures()->trim();
+            });
+        }
+    }
+    settings.set("chunk_cache_mb", cache_mb);
+    Engine.map()->create_map(Engine.screen()->get_size());
+}
+
+// full screen frames, each after 2 ms standing in for the input and simulation of the next one,
+// present_serial waits for every copy, with frames in flight the copy overlaps that work
+static void bench_present(int frames) {
+    auto& settings = Engine.config("settings");
+    const Size size = Engine.screen()->get_size();
+    for (int in_flight : {0, 1, 2}) {
+        settings.set("max_frames_in_flight", std::max(1, in_flight));
+        Screen* screen = new Screen(size);
+        char name[64];
+        snprintf(name, sizeof(name), in_flight ? "present_in_flight_%d" : "present_serial", in_flight);
+        measure(name, frames, 10, [&]() {
+            const long long until = now() + 2000;
+            while (now() < until) {}
+            screen->damage(Box(Point(0, 0), size));
+            screen->draw();
+            screen->present();
+            if (!in_flight) {
+                screen->finish_present();
+            }
+        });
+        delete screen;
+    }
+    settings.set("max_frames_in_flight", 0);
+}
+
+// with 2 MB, about 50 chunks of the map stay resident, walking the camera pages some in and writes
+// others back every few frames, the map must read the same afterwards, also from a snapshot
+// written while it is paged and changed
+static void bench_paging(int frames) {
+    auto& settings = Engine.config("settings");
+    const int resident_mb = settings["map_resident_mb"].i();
+    const Size map_size = Engine.map()->tilemap_size();
+    auto checksum = [&]() {
+        unsigned sum = 0;
+        for (short y = 0; y < map_size.h; y++) {
+            for (short x = 0; x < map_size.w; x++) {
+                sum = sum * 31 + Engine.map()->get_ground(Point(x, y));
+            }
+        }
+        return sum;
+    };
+    const unsigned expected = checksum();
+    for (int mb : {0, 2}) {
+        settings.set("map_resident_mb", mb);
+        Engine.map()->create_map(Engine.screen()->get_size());
+        Engine.map()->set_zoom(1);
+        Engine.map()->move_cam_to_tile({0, 0});
+        measure(mb ? "render_walk_paged" : "render_walk_resident", frames, 10, []() {
+            Engine.map()->move_cam({200, 100});
+            Engine.screen()->draw();
+            Engine.textures()->trim();
+        });
+    }
+    const unsigned paged = checksum();
+    Snapshot* snapshot = Engine.db()->snapshot();
+    for (short y = 0; y < map_size.h; y += 64) {
+        for (short x = 0; x < map_size.w; x += 64) {
+            Engine.map()->set_ground(Engine.map()->get_ground(Point(x, y)) + 1, Point(x, y), false);
+        }
+    }
+    const unsigned changed = checksum();
+    snapshot->write("bench.sav");
+    Engine.db()->release(snapshot);
+    Engine.db()->read("bench.sav");
+    std::remove("bench.sav");
+    Engine.textures()->reinit();
+    Engine.map()->create_map(Engine.screen()->get_size());
+    const unsigned saved = checksum();
+    settings.set("map_resident_mb", resident_mb);
+    Engine.map()->create_map(Engine.screen()->get_size());
+    if (paged != expected || changed == expected || saved != expected) {
+        fprintf(stderr, "map checksum %08x, paged %08x, changed %08x, saved %08x\n", expected, paged, changed, saved);
+        exit(1);
+    }
+}
+
+class CountEvent : public Simulation::Event {
+    public:
+        void execute() { count++; }
+        long long count = 0;
+};
+
+static void bench_simulation() {
+    constexpr int NUM_EVENTS = 256;
+    constexpr int NUM_SLICES = 64;
+    CountEvent* event = new CountEvent();
+    std::vector<std::string> names;
+    for (int i = 0; i < NUM_EVENTS; i++) {
+        names.push_back("bench_event_" + std::to_string(i));
+        Engine.sim()->register_event(names.back(), event);
+    }
+    auto queue = [&]() {
+        for (int t = 1; t <= NUM_SLICES; t++) {
+            for (auto& name : names) {
+                Engine.sim()->queue_event(name, t);
+            }
+        }
+    };
+    Engine.sim()->toggle(true);
+    measure("sim_queue_" + std::to_string(NUM_SLICES * NUM_EVENTS), 20, 2, queue, []() { Engine.sim()->step(NUM_SLICES); });
+    measure("sim_step_" + std::to_string(NUM_SLICES * NUM_EVENTS), 20, 2, []() { Engine.sim()->step(NUM_SLICES); }, queue);
+}
+
+static void bench_lua() {
+    constexpr int NUM_CALLS = 100000;
+    Engine.register_script_function({"Bench_noop", {ScriptType::NUMBER}, [](const std::vector<ScriptParam>& params) { return params[0]; }});
+    FileHandle file = file_open("bench_calls.lua");
+    file_writeline(file, "for i = 1, " + std::to_string(NUM_CALLS) + " do Bench_noop(i) end");
+    file_close(file);
+    file = file_open("bench_loop.lua");
+    file_writeline(file, "local x = 0 for i = 1, " + std::to_string(NUM_CALLS) + " do x = x + i end");
+    file_close(file);
+    measure("lua_loop_" + std::to_string(NUM_CALLS), 20, 2, []() { Engine.execute_script("bench_loop.lua"); });
+    measure("lua_calls_" + std::to_string(NUM_CALLS), 20, 2, []() { Engine.execute_script("bench_calls.lua"); });
+    std::remove("bench_calls.lua");
+    std::remove("bench_loop.lua");
+}
+
+int main(int argc, char** argv) {
+    int frames = 200;
+    std::string out;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (std::string(argv[i]) == "--frames") frames = atoi(argv[i + 1]);
+        else if (std::string(argv[i]) == "--out") out = argv[i + 1];
+    }
+    if (!getenv("ENGINE_HEADLESS")) {
+#ifdef _WIN32
+        _putenv_s("ENGINE_HEADLESS", "1");
+#else
+        setenv("ENGINE_HEADLESS", "1", 0);
+#endif
+    }
+    Engine.init();
+    Engine.textures()->add_folder("./res/textures");
+    Engine.textures()->set_font("./res/mono.ttf");
+    set_map_size({1024, 1024});
+    Engine.screen()->add_child(Engine.map(), {0, 0});
+    Engine.map()->randomize_map();
+
+    bench_render(frames);
+    bench_chunk_cache(frames);
+    bench_present(frames);
+    bench_simulation();
+    bench_lua();
+    bench_database();
+    bench_mapgen();
+    bench_paging(frames);
+
+    FILE* file = out.empty() ? stdout : fopen(out.c_str(), "w");
+    if (!file) {
+        fprintf(stderr, "cannot write %s\n", out.c_str());
+        return 1;
+    }
+    write_json(file);
+    if (file != stdout) {
+        fclose(file);
+    }
+    return 0;
+}
@@ -0,0 +1,228 @@
+#include "util.h"
+
+#include <cstdlib>
+
+// Alpha blending kernels, selected once at startup depending on the CPU.
+// All variants compute exactly the same 32 bit integer formula as the scalar one.
+
+using BlendFunc = void (*)(unsigned*, const unsigned*, const unsigned*, int);
+using BlendColorFunc = void (*)(unsigned*, unsigned, int);
+
+static inline unsigned blend_pixel(unsigned color1, unsigned color2) {
+    unsigned rb = (color1 & 0xff00ff) + (((color2 & 0xff00ff) - (color1 & 0xff00ff)) * ((color2 & 0xff000000) >> 24) >> 8);
+    unsigned g  = (color1 & 0x00ff00) + (((color2 & 0x00ff00) - (color1 & 0x00ff00)) * ((color2 & 0xff000000) >> 24) >> 8);
+    return (rb & 0xff00ff) | (g & 0x00ff00);
+}
+
+static void blend_scalar(unsigned* dst, const unsigned* below, const unsigned* above, int n) {
+    for (int x = 0; x < n; x++) {
+        dst[x] = blend_pixel(below[x], above[x]);
+    }
+}
+
+static void blend_color_scalar(unsigned* dst, unsigned color, int n) {
+    for (int x = 0; x < n; x++) {
+        dst[x] = blend_pixel(dst[x], color);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BLEND_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET(t)
+#else
+#define TARGET(t) __attribute__((target(t)))
+#endif
+
+// SSE2 has no 32 bit mullo, so multiply even and odd lanes separately
+static inline __m128i mullo_sse2(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static void blend_sse2(unsigned* dst, const unsigned* below, const unsigned* above, int n) {
+    const __m128i mask_rb = _mm_set1_epi32(0xff00ff);
+    const __m128i mask_g = _mm_set1_epi32(0x00ff00);
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        __m128i color1 = _mm_loadu_si128((const __m128i*)(below + x));
+        __m128i color2 = _mm_loadu_si128((const __m128i*)(above + x));
+        __m128i alpha = _mm_srli_epi32(color2, 24);
+        __m128i rb1 = _mm_and_si128(color1, mask_rb);
+        __m128i g1 = _mm_and_si128(color1, mask_g);
+        __m128i rb = _mm_add_epi32(rb1, _mm_srli_epi32(mullo_sse2(_mm_sub_epi32(_mm_and_si128(color2, mask_rb), rb1), alpha), 8));
+        __m128i g = _mm_add_epi32(g1, _mm_srli_epi32(mullo_sse2(_mm_sub_epi32(_mm_and_si128(color2, mask_g), g1), alpha), 8));
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_or_si128(_mm_and_si128(rb, mask_rb), _mm_and_si128(g, mask_g)));
+    }
+    blend_scalar(dst + x, below + x, above + x, n - x);
+}
+
+// with a single color the masked color channels and the alpha are loop invariant
+static void blend_color_sse2(unsigned* dst, unsigned color, int n) {
+    const __m128i mask_rb = _mm_set1_epi32(0xff00ff);
+    const __m128i mask_g = _mm_set1_epi32(0x00ff00);
+    const __m128i alpha = _mm_set1_epi32(color >> 24);
+    const __m128i rb2 = _mm_set1_epi32(color & 0xff00ff);
+    const __m128i g2 = _mm_set1_epi32(color & 0x00ff00);
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        __m128i color1 = _mm_loadu_si128((const __m128i*)(dst + x));
+        __m128i rb1 = _mm_and_si128(color1, mask_rb);
+        __m128i g1 = _mm_and_si128(color1, mask_g);
+        __m128i rb = _mm_add_epi32(rb1, _mm_srli_epi32(mullo_sse2(_mm_sub_epi32(rb2, rb1), alpha), 8));
+        __m128i g = _mm_add_epi32(g1, _mm_srli_epi32(mullo_sse2(_mm_sub_epi32(g2, g1), alpha), 8));
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_or_si128(_mm_and_si128(rb, mask_rb), _mm_and_si128(g, mask_g)));
+    }
+    blend_color_scalar(dst + x, color, n - x);
+}
+
+TARGET("avx2")
+static void blend_color_avx2(unsigned* dst, unsigned color, int n) {
+    const __m256i mask_rb = _mm256_set1_epi32(0xff00ff);
+    const __m256i mask_g = _mm256_set1_epi32(0x00ff00);
+    const __m256i alpha = _mm256_set1_epi32(color >> 24);
+    const __m256i rb2 = _mm256_set1_epi32(color & 0xff00ff);
+    const __m256i g2 = _mm256_set1_epi32(color & 0x00ff00);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i color1 = _mm256_loadu_si256((const __m256i*)(dst + x));
+        __m256i rb1 = _mm256_and_si256(color1, mask_rb);
+        __m256i g1 = _mm256_and_si256(color1, mask_g);
+        __m256i rb = _mm256_add_epi32(rb1, _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(rb2, rb1), alpha), 8));
+        __m256i g = _mm256_add_epi32(g1, _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(g2, g1), alpha), 8));
+        _mm256_storeu_si256((__m256i*)(dst + x), _mm256_or_si256(_mm256_and_si256(rb, mask_rb), _mm256_and_si256(g, mask_g)));
+    }
+    blend_color_sse2(dst + x, color, n - x);
+}
+
+// the shift intrinsics start from _mm512_undefined_epi32(), which GCC reports as uninitialized
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+TARGET("avx512f")
+static void blend_color_avx512(unsigned* dst, unsigned color, int n) {
+    const __m512i mask_rb = _mm512_set1_epi32(0xff00ff);
+    const __m512i mask_g = _mm512_set1_epi32(0x00ff00);
+    const __m512i alpha = _mm512_set1_epi32(color >> 24);
+    const __m512i rb2 = _mm512_set1_epi32(color & 0xff00ff);
+    const __m512i g2 = _mm512_set1_epi32(color & 0x00ff00);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m512i color1 = _mm512_loadu_si512((const void*)(dst + x));
+        __m512i rb1 = _mm512_and_si512(color1, mask_rb);
+        __m512i g1 = _mm512_and_si512(color1, mask_g);
+        __m512i rb = _mm512_add_epi32(rb1, _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_sub_epi32(rb2, rb1), alpha), 8));
+        __m512i g = _mm512_add_epi32(g1, _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_sub_epi32(g2, g1), alpha), 8));
+        _mm512_storeu_si512((void*)(dst + x), _mm512_or_si512(_mm512_and_si512(rb, mask_rb), _mm512_and_si512(g, mask_g)));
+    }
+    blend_color_avx2(dst + x, color, n - x);
+}
+
+TARGET("avx2")
+static void blend_avx2(unsigned* dst, const unsigned* below, const unsigned* above, int n) {
+    const __m256i mask_rb = _mm256_set1_epi32(0xff00ff);
+    const __m256i mask_g = _mm256_set1_epi32(0x00ff00);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i color1 = _mm256_loadu_si256((const __m256i*)(below + x));
+        __m256i color2 = _mm256_loadu_si256((const __m256i*)(above + x));
+        __m256i alpha = _mm256_srli_epi32(color2, 24);
+        __m256i rb1 = _mm256_and_si256(color1, mask_rb);
+        __m256i g1 = _mm256_and_si256(color1, mask_g);
+        __m256i rb = _mm256_add_epi32(rb1, _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(_mm256_and_si256(color2, mask_rb), rb1), alpha), 8));
+        __m256i g = _mm256_add_epi32(g1, _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(_mm256_and_si256(color2, mask_g), g1), alpha), 8));
+        _mm256_storeu_si256((__m256i*)(dst + x), _mm256_or_si256(_mm256_and_si256(rb, mask_rb), _mm256_and_si256(g, mask_g)));
+    }
+    blend_sse2(dst + x, below + x, above + x, n - x);
+}
+
+TARGET("avx512f")
+static void blend_avx512(unsigned* dst, const unsigned* below, const unsigned* above, int n) {
+    const __m512i mask_rb = _mm512_set1_epi32(0xff00ff);
+    const __m512i mask_g = _mm512_set1_epi32(0x00ff00);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m512i color1 = _mm512_loadu_si512((const void*)(below + x));
+        __m512i color2 = _mm512_loadu_si512((const void*)(above + x));
+        __m512i alpha = _mm512_srli_epi32(color2, 24);
+        __m512i rb1 = _mm512_and_si512(color1, mask_rb);
+        __m512i g1 = _mm512_and_si512(color1, mask_g);
+        __m512i rb = _mm512_add_epi32(rb1, _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_sub_epi32(_mm512_and_si512(color2, mask_rb), rb1), alpha), 8));
+        __m512i g = _mm512_add_epi32(g1, _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_sub_epi32(_mm512_and_si512(color2, mask_g), g1), alpha), 8));
+        _mm512_storeu_si512((void*)(dst + x), _mm512_or_si512(_mm512_and_si512(rb, mask_rb), _mm512_and_si512(g, mask_g)));
+    }
+    blend_avx2(dst + x, below + x, above + x, n - x);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+static std::string detect_cpu() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    bool os_avx = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+    bool os_avx512 = os_avx && (_xgetbv(0) & 0xe6) == 0xe6;
+    __cpuidex(info, 7, 0);
+    if (os_avx512 && (info[1] & (1 << 16))) return "avx512";
+    if (os_avx && (info[1] & (1 << 5))) return "avx2";
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return "avx512";
+    if (__builtin_cpu_supports("avx2")) return "avx2";
+#endif
+    return "sse2";
+}
+#endif
+
+static BlendFunc select_blend(const std::string& isa) {
+#ifdef BLEND_X86
+    if (isa == "avx512") return blend_avx512;
+    if (isa == "avx2") return blend_avx2;
+    if (isa == "sse2") return blend_sse2;
+#endif
+    (void)isa;
+    return blend_scalar;
+}
+
+static BlendColorFunc select_blend_color(const std::string& isa) {
+#ifdef BLEND_X86
+    if (isa == "avx512") return blend_color_avx512;
+    if (isa == "avx2") return blend_color_avx2;
+    if (isa == "sse2") return blend_color_sse2;
+#endif
+    (void)isa;
+    return blend_color_scalar;
+}
+
+static std::string cpu_isa() {
+    // ENGINE_SIMD=scalar|sse2|avx2|avx512 caps the kernel, e.g. to compare outputs between machines
+    const char* forced = getenv("ENGINE_SIMD");
+#ifdef BLEND_X86
+    std::string detected = detect_cpu();
+    const std::vector<std::string> levels = {"scalar", "sse2", "avx2", "avx512"};
+    if (forced && std::find(levels.begin(), levels.end(), forced) < std::find(levels.begin(), levels.end(), detected)) {
+        return forced;
+    }
+    return detected;
+#else
+    (void)forced;
+    return "scalar";
+#endif
+}
+
+static const std::string blend_isa = cpu_isa();
+static const BlendFunc blend_impl = select_blend(blend_isa);
+static const BlendColorFunc blend_color_impl = select_blend_color(blend_isa);
+
+void blend_row(unsigned* dst, const unsigned* below, const unsigned* above, int n) { blend_impl(dst, below, above, n); }
+
+void blend_color_row(unsigned* dst, unsigned color, int n) { blend_color_impl(dst, color, n); }
+
+std::string simd_level() { return blend_isa; }
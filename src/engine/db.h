@@ -2,6 +2,10 @@
 #define DB_H
 
 #include "util.h"
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <type_traits>
 
 class CompressedFile {
     public:
@@ -16,6 +20,9 @@ class CompressedFile {
         if (write_mode && buffer_pos > 0) {
             write_block();
         }
+        while (!pending.empty()) {
+            write_pending();
+        }
         file_close(file);
     }
 
@@ -28,31 +35,70 @@ class CompressedFile {
         }
     }
 
-    void read(char* s, int n) {
+    // false if the file ended before n bytes, e.g. when it was cut off by a crash
+    bool read(char* s, int n) {
         for (int i = 0; i < n; i++) {
+            if (ended) {
+                return false;
+            }
             s[i] = buffer[buffer_pos++];
             if (buffer_pos >= BLOCK_SIZE) {
                 read_block();
             }
         }
+        return true;
     }
 
+    // blocks are compressed in parallel jobs and written in order
     void write_block() {
-        compress(buffer, BLOCK_SIZE, comp_buffer, comp_block_size);
-        file_write(file, (char*)(&comp_block_size), sizeof(comp_block_size));
-        file_write(file, comp_buffer, comp_block_size);
+        PendingBlock* block = new PendingBlock();
+        block->data.assign(buffer, buffer + BLOCK_SIZE);
+        block->job = run_background_job([block]() {
+            std::vector<char> out(2 * BLOCK_SIZE);
+            compress(block->data.data(), BLOCK_SIZE, out.data(), block->size);
+            out.resize(block->size);
+            block->data.swap(out);
+        });
+        pending.push_back(block);
+        if ((int)pending.size() > 2 * num_workers()) {
+            write_pending();
+        }
         buffer_pos = 0;
     }
 
+    void write_pending() {
+        PendingBlock* block = pending.front();
+        wait_job(block->job);
+        file_write(file, (char*)(&block->size), sizeof(block->size));
+        file_write(file, block->data.data(), block->size);
+        pending.erase(pending.begin());
+        delete block;
+    }
+
     void read_block() {
+        buffer_pos = 0;
         file_read(file, (char*)(&comp_block_size), sizeof(comp_block_size));
+        if (file_isend(file) || comp_block_size <= 0 || comp_block_size > 2 * BLOCK_SIZE) {
+            ended = true;
+            return;
+        }
         file_read(file, comp_buffer, comp_block_size);
+        if (file_isend(file)) {
+            ended = true;
+            return;
+        }
         decompress(comp_buffer, comp_block_size, buffer, 2 * BLOCK_SIZE);
-        buffer_pos = 0;
     }
 
+    struct PendingBlock {
+        std::vector<char> data;
+        int size = 0;
+        JobHandle job;
+    };
+    std::vector<PendingBlock*> pending;
     int comp_block_size = 0;
     bool write_mode;
+    bool ended = false;
     static constexpr int BLOCK_SIZE = 32000;
     FileHandle file;
     int buffer_pos = 0;
@@ -60,17 +106,305 @@ class CompressedFile {
     char comp_buffer[2 * BLOCK_SIZE];
 };
 
+// Maps the keys of a table to row offsets. SORTED keeps the entries ordered by key in one array,
+// for tables that are iterated in order. HASH finds keys by open addressing and iterates in
+// insertion order, for point lookups.
+class KeyIndex {
+    public:
+        enum Type {SORTED, HASH};
+        struct Entry {
+            int key;
+            int offset;
+        };
+
+        KeyIndex(Type t = SORTED): index_type(t) {}
+
+        Type type() { return index_type; }
+        void set_type(Type t) {
+            if (t != index_type) {
+                index_type = t;
+                rebuild();
+            }
+        }
+
+        int size() { return entries.size(); }
+        Entry* begin() { return entries.data(); }
+        Entry* end() { return entries.data() + entries.size(); }
+
+        // offset of the key, nullptr if it does not exist
+        int* find(int key) {
+            if (index_type == SORTED) {
+                auto it = lower_bound(key);
+                return it != entries.end() && it->key == key ? &it->offset : nullptr;
+            }
+            if (slots.empty()) {
+                return nullptr;
+            }
+            for (size_t slot = hash(key); ; slot = (slot + 1) & (slots.size() - 1)) {
+                if (slots[slot] < 0) {
+                    return nullptr;
+                }
+                if (entries[slots[slot]].key == key) {
+                    return &entries[slots[slot]].offset;
+                }
+            }
+        }
+
+        // like std::map::operator[], a missing key is added with offset 0
+        int& operator[](int key) {
+            int* offset = find(key);
+            if (!offset) {
+                insert(key, 0);
+                offset = find(key);
+            }
+            return *offset;
+        }
+
+        void insert(int key, int offset) {
+            int* existing = find(key);
+            if (existing) {
+                *existing = offset;
+                return;
+            }
+            if (index_type == SORTED) {
+                if (entries.empty() || entries.back().key < key) {
+                    entries.push_back({key, offset});
+                } else {
+                    entries.insert(lower_bound(key), {key, offset});
+                }
+                return;
+            }
+            entries.push_back({key, offset});
+            if (2 * entries.size() > slots.size()) {
+                rebuild();
+            } else {
+                place(entries.size() - 1);
+            }
+        }
+
+        void erase(int key) {
+            if (index_type == SORTED) {
+                auto it = lower_bound(key);
+                if (it != entries.end() && it->key == key) {
+                    entries.erase(it);
+                }
+                return;
+            }
+            if (slots.empty()) {
+                return;
+            }
+            size_t slot = hash(key);
+            while (slots[slot] >= 0 && entries[slots[slot]].key != key) {
+                slot = (slot + 1) & (slots.size() - 1);
+            }
+            if (slots[slot] < 0) {
+                return;
+            }
+            // the last entry fills the gap in the array
+            const int removed = slots[slot];
+            const int last = entries.size() - 1;
+            if (removed != last) {
+                entries[removed] = entries[last];
+                size_t last_slot = hash(entries[removed].key);
+                while (slots[last_slot] != last) {
+                    last_slot = (last_slot + 1) & (slots.size() - 1);
+                }
+                slots[last_slot] = removed;
+            }
+            entries.pop_back();
+            // moves the following entries of the probe sequence back into the gap
+            size_t gap = slot;
+            slots[gap] = -1;
+            for (size_t next = (gap + 1) & (slots.size() - 1); slots[next] >= 0; next = (next + 1) & (slots.size() - 1)) {
+                const size_t home = hash(entries[slots[next]].key);
+                if (((next - home) & (slots.size() - 1)) >= ((next - gap) & (slots.size() - 1))) {
+                    slots[gap] = slots[next];
+                    slots[next] = -1;
+                    gap = next;
+                }
+            }
+        }
+
+        // replaces all entries at once, e.g. when a table is read
+        void assign(const std::vector<Entry>& e) {
+            entries = e;
+            rebuild();
+        }
+
+    private:
+        Type index_type;
+        std::vector<Entry> entries;
+        std::vector<int> slots; // entry of every hash slot or -1, a power of two at least twice the entries
+
+        size_t hash(int key) { return ((unsigned)key * 2654435769u) & (slots.size() - 1); }
+
+        std::vector<Entry>::iterator lower_bound(int key) {
+            return std::lower_bound(entries.begin(), entries.end(), key, [](const Entry& e, int k) { return e.key < k; });
+        }
+
+        void place(int entry) {
+            size_t slot = hash(entries[entry].key);
+            while (slots[slot] >= 0) {
+                slot = (slot + 1) & (slots.size() - 1);
+            }
+            slots[slot] = entry;
+        }
+
+        void rebuild() {
+            slots.clear();
+            if (index_type == SORTED) {
+                std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.key < b.key; });
+                return;
+            }
+            size_t n = 16;
+            while (n < 2 * entries.size() + 2) {
+                n *= 2;
+            }
+            slots.assign(n, -1);
+            for (int i = 0; i < (int)entries.size(); i++) {
+                place(i);
+            }
+        }
+};
+
+// Uniform grid over keys that are packed Points, for tables of things placed on the map. Every
+// cell keeps the keys inside it, so queries only visit the cells that overlap the searched area.
+class SpatialIndex {
+    public:
+        bool enabled() { return cell_size > 0; }
+        void enable(int cell) { cell_size = std::max(1, cell); cells.clear(); count = 0; }
+
+        void insert(int key) {
+            cells[cell_key(Point(key))].push_back(key);
+            count++;
+        }
+
+        void erase(int key) {
+            auto it = cells.find(cell_key(Point(key)));
+            if (it == cells.end()) return;
+            auto& keys = it->second;
+            auto k = std::find(keys.begin(), keys.end(), key);
+            if (k == keys.end()) return;
+            *k = keys.back();
+            keys.pop_back();
+            if (keys.empty()) cells.erase(it);
+            count--;
+        }
+
+        void clear() { cells.clear(); count = 0; }
+        int size() { return count; }
+
+        // keys inside the box, corners included
+        void inside(Box box, std::vector<int>& keys) {
+            int x1 = std::min(box.a.x, box.b.x), x2 = std::max(box.a.x, box.b.x);
+            int y1 = std::min(box.a.y, box.b.y), y2 = std::max(box.a.y, box.b.y);
+            visit(x1, y1, x2, y2, [&](int key, Point p) {
+                if (p.x >= x1 && p.x <= x2 && p.y >= y1 && p.y <= y2) keys.push_back(key);
+            });
+        }
+
+        // keys within manhattan distance radius of the center
+        void within(Point center, int radius, std::vector<int>& keys) {
+            visit(center.x - radius, center.y - radius, center.x + radius, center.y + radius, [&](int key, Point p) {
+                if (std::abs(p.x - center.x) + std::abs(p.y - center.y) <= radius) keys.push_back(key);
+            });
+        }
+
+    private:
+        int cell_size = 0;
+        int count = 0;
+        std::unordered_map<int, std::vector<int>> cells;
+
+        int cell(int v) { return v >= 0 ? v / cell_size : (v - cell_size + 1) / cell_size; }
+        int cell_key(Point p) { return int(Point(cell(p.x), cell(p.y))); }
+
+        template <typename F>
+        void visit(int x1, int y1, int x2, int y2, F f) {
+            long long area = (long long)(cell(x2) - cell(x1) + 1) * (cell(y2) - cell(y1) + 1);
+            if (area > (long long)cells.size()) {
+                // large areas are cheaper to answer from the occupied cells
+                for (auto& c : cells) {
+                    for (int key : c.second) f(key, Point(key));
+                }
+                return;
+            }
+            for (int cy = cell(y1); cy <= cell(y2); cy++) {
+                for (int cx = cell(x1); cx <= cell(x2); cx++) {
+                    auto it = cells.find(int(Point(cx, cy)));
+                    if (it == cells.end()) continue;
+                    for (int key : it->second) f(key, Point(key));
+                }
+            }
+        }
+};
+
+// Keeps the contents a buffer had when a snapshot was taken. While the log is active, the owner
+// calls before_write for every range it is about to change and the first write to a page copies
+// it. Readers hold the mutex and take each page from its copy if there is one and from the live
+// buffer otherwise, so the owner also holds the mutex while it moves the buffer.
+class PageLog {
+    public:
+        constexpr static size_t PAGE_SIZE = 16 * 1024;
+
+        bool active() { return frozen; }
+        int copied_pages() { return std::count_if(copies.begin(), copies.end(), [](auto& c) { return !c.empty(); }); }
+
+        void begin(size_t size) {
+            frozen = true;
+            frozen_size = size;
+            copies.assign((size + PAGE_SIZE - 1) / PAGE_SIZE, {});
+        }
+
+        void end() {
+            std::lock_guard<std::mutex> lock(mutex);
+            frozen = false;
+            copies.clear();
+        }
+
+        void before_write(const char* mem, size_t offset, size_t len) {
+            size_t last = std::min(offset + len, frozen_size);
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t p = offset / PAGE_SIZE; p * PAGE_SIZE < last; p++) {
+                if (copies[p].empty()) {
+                    size_t start = p * PAGE_SIZE;
+                    copies[p].assign(mem + start, mem + std::min(start + PAGE_SIZE, frozen_size));
+                }
+            }
+        }
+
+        // copies frozen bytes, called with the mutex held
+        void read(const char* mem, size_t offset, size_t len, char* out) {
+            while (len > 0) {
+                size_t p = offset / PAGE_SIZE;
+                size_t in_page = offset % PAGE_SIZE;
+                size_t n = std::min(len, PAGE_SIZE - in_page);
+                std::memcpy(out, copies[p].empty() ? mem + offset : copies[p].data() + in_page, n);
+                out += n;
+                offset += n;
+                len -= n;
+            }
+        }
+
+        std::mutex mutex;
+
+    private:
+        bool frozen = false;
+        size_t frozen_size = 0;
+        std::vector<std::vector<char>> copies;
+};
+
 class TableBase {
     public:
         void write(CompressedFile& file) {
+            vacuum();
             int namesize = name.size();
             file.write((char*)(&namesize), sizeof(namesize)); 
             file.write(name.c_str(), name.size());
-            int nRows = keyToIndex.size();
+            int nRows = index.size();
             file.write((char*)(&nRows), sizeof(nRows)); 
-            for (auto& k : keyToIndex) {
-                file.write((char*)(&k.first), sizeof(k.first)); 
-                file.write((char*)(&k.second), sizeof(k.second)); 
+            for (auto& k : index) {
+                file.write((char*)(&k.key), sizeof(k.key)); 
+                file.write((char*)(&k.offset), sizeof(k.offset)); 
             }
             int nDeleted = deletedIndices.size();
             file.write((char*)(&nDeleted), sizeof(nDeleted)); 
@@ -84,13 +418,12 @@ class TableBase {
         void read(CompressedFile& file) {
             int nRows = -1;
             file.read((char*)(&nRows), sizeof(nRows));
-            for (int i = 0; i < nRows; i++) {
-                int key = 0;
-                int value = 0;
-                file.read((char*)(&key), sizeof(key)); 
-                file.read((char*)(&value), sizeof(value)); 
-                keyToIndex[key] = value;
+            std::vector<KeyIndex::Entry> entries(nRows);
+            for (auto& e : entries) {
+                file.read((char*)(&e.key), sizeof(e.key)); 
+                file.read((char*)(&e.offset), sizeof(e.offset)); 
             }
+            index.assign(entries);
             int nDeleted = 0;
             file.read((char*)(&nDeleted), sizeof(nDeleted)); 
             for (int i = 0; i < nDeleted; i++) {
@@ -101,78 +434,184 @@ class TableBase {
             file.read((char*)(&elem_size), sizeof(elem_size)); 
             mem.resize(elem_size * nRows);
             file.read((char*)(mem.data()), nRows * elem_size);
+            index_points();
+        }
+
+        void clear() {
+            mem.clear();
+            index.assign({});
+            deletedIndices.clear();
+            spatial.clear();
+            scattered = 0;
+        }
+
+        // rewrites the rows densely in iteration order, so scans walk memory sequentially again
+        void vacuum() {
+            if (!scattered && deletedIndices.empty()) return;
+            std::vector<char> dense(index.size() * elem_size);
+            int offset = 0;
+            for (auto e = index.begin(); e != index.end(); ++e) {
+                std::memcpy(dense.data() + offset, mem.data() + e->offset, elem_size);
+                e->offset = offset;
+                offset += elem_size;
+            }
+            if (log.active()) log.before_write(mem.data(), 0, mem.size());
+            std::lock_guard<std::mutex> lock(log.mutex);
+            mem.swap(dense);
+            deletedIndices.clear();
+            scattered = 0;
+        }
+
+        KeyIndex::Type index_type() { return index.type(); }
+        void set_index_type(KeyIndex::Type t) { index.set_type(t); }
+
+        // for tables keyed by packed Points, keeps a grid of cell_size tiles in sync with the keys
+        void set_spatial_index(int cell_size) {
+            spatial.enable(cell_size);
+            index_points();
+        }
+
+        // keys of the rows within manhattan distance radius of the center, needs a spatial index
+        std::vector<int> within(Point center, int radius) {
+            std::vector<int> keys;
+            spatial.within(center, radius, keys);
+            return keys;
+        }
+
+        // keys of the rows inside the box, corners included, needs a spatial index
+        std::vector<int> inside(Box box) {
+            std::vector<int> keys;
+            spatial.inside(box, keys);
+            return keys;
         }
     
     protected:
         std::vector<char> mem;
-        std::map<int, int> keyToIndex;
+        KeyIndex index;
+        SpatialIndex spatial;
         std::vector<int> deletedIndices;
         std::string name;
         int elem_size;
+        int scattered = 0; // holes and rows out of iteration order since the last vacuum
+        PageLog log;
+
+        void touch(int offset) {
+            if (log.active()) log.before_write(mem.data(), offset, elem_size);
+        }
+
+        friend class Snapshot;
+
+        // the rows are rewritten once this many are scattered, and at least a quarter of the table
+        constexpr static int VACUUM_MIN_ROWS = 64;
+        bool fragmented() { return scattered >= VACUUM_MIN_ROWS && 4 * scattered >= (int)index.size(); }
+
+        void index_points() {
+            if (!spatial.enabled()) return;
+            spatial.clear();
+            for (auto e = index.begin(); e != index.end(); ++e) spatial.insert(e->key);
+        }
 };
 
 template <typename T>
 class Table : public TableBase {
     public:
-        class Iterator {
+        // rows reached through a writing iterator count as changed for an open snapshot, reading
+        // ones leave its pages alone
+        template <bool writes>
+        class BasicIterator {
             public:
-                Iterator(std::map<int, int>::iterator i, Table<T>& t): it(i), table(t) {}
-                Iterator& operator++() { ++it; return *this; }
-                bool operator!=(const Iterator & other) const { return it != other.it; }
-                T& operator*() { return table.get(it->first); }
-                int key() { return it->first; }
+                using Row = typename std::conditional<writes, T, const T>::type;
+                BasicIterator(KeyIndex::Entry* e, Table<T>& t): entry(e), table(t) {}
+                BasicIterator& operator++() { ++entry; return *this; }
+                bool operator!=(const BasicIterator& other) const { return entry != other.entry; }
+                Row& operator*() {
+                    if (writes) table.touch(entry->offset);
+                    return *(Row*)(table.mem.data() + entry->offset);
+                }
+                int key() { return entry->key; }
             private:
-                std::map<int, int>::iterator it;
+                KeyIndex::Entry* entry;
                 Table<T>& table;
         };
+        using Iterator = BasicIterator<true>;
+        using ReadIterator = BasicIterator<false>;
+        struct ReadRows {
+            ReadIterator first;
+            ReadIterator last;
+            ReadIterator begin() { return first; }
+            ReadIterator end() { return last; }
+        };
 
-        Iterator begin() { return Iterator(keyToIndex.begin(), *this); } 
-        Iterator end() { return Iterator(keyToIndex.end(), *this); }
+        Iterator begin() { return Iterator(index.begin(), *this); } 
+        Iterator end() { return Iterator(index.end(), *this); }
+        ReadRows read_rows() { return {ReadIterator(index.begin(), *this), ReadIterator(index.end(), *this)}; }
         
         Table(const std::string& table_name) {
             name = table_name;
             elem_size = sizeof(T);
         }
 
+        // like growing the table, compaction moves rows, so references to rows do not survive an add
         template <typename ...Ts>
         T& add(int key, Ts const&... values) {
+            if (fragmented() && !log.active()) {
+                vacuum();
+            }
             int idx = -1;
             if (deletedIndices.empty()) {
-                idx = keyToIndex.size() * elem_size;
+                idx = index.size() * elem_size;
+                std::lock_guard<std::mutex> lock(log.mutex);
                 mem.resize(idx + elem_size);
             } else {
                 idx = *(deletedIndices.end()-1);
                 deletedIndices.pop_back();
+                scattered++;
+                touch(idx);
             }    
-            keyToIndex[key] = idx;
+            if (spatial.enabled() && !exists(key)) spatial.insert(key);
+            index.insert(key, idx);
+            if (index.type() == KeyIndex::SORTED && (index.end() - 1)->key != key) scattered++;
             return *(new ((char*)mem.data() + idx) T(values...));
         }
 
         T& get(int key) {
-            return *(T*)((char*)mem.data() + keyToIndex[key]);
+            int offset = index[key];
+            touch(offset);
+            return *(T*)((char*)mem.data() + offset);
         }
+        // for rows that are only looked at, an open snapshot does not copy their page
+        const T& read(int key) { return *(const T*)((char*)mem.data() + index[key]); }
         
         void erase(int key) {
-            deletedIndices.push_back(keyToIndex[key]);
-            keyToIndex.erase(keyToIndex.find(key));
+            deletedIndices.push_back(index[key]);
+            index.erase(key);
+            scattered++;
+            if (spatial.enabled()) spatial.erase(key);
         }
 
-        bool exists(int key) { return keyToIndex.find(key) != keyToIndex.end(); }
+        bool exists(int key) { return index.find(key) != nullptr; }
 };
 
 class MatrixBase {
     public:
-        void write(CompressedFile& file) {
+        // copied a band of rows at a time, so with a snapshot open the game waits at most for one band
+        void write(CompressedFile& file, bool frozen = false) {
             int namesize = name.size();
             file.write((char*)(&namesize), sizeof(namesize)); 
             file.write(name.c_str(), name.size());
             file.write((char*)(&w), sizeof(w)); 
             file.write((char*)(&h), sizeof(h)); 
             file.write((char*)(&elem_size), sizeof(elem_size)); 
-            file.write(mem, w * h * elem_size);
+            const int band = band_rows();
+            std::vector<char> rows((size_t)band * w * elem_size);
+            for (int y = 0; y < h; y += band) {
+                const int n = std::min(band, h - y);
+                copy_rows(y, n, rows.data(), frozen);
+                file.write(rows.data(), (size_t)n * w * elem_size);
+            }
         }
         
-        void read(CompressedFile& file) {
+        virtual void read(CompressedFile& file) {
             file.read((char*)(&w), sizeof(w)); 
             file.read((char*)(&h), sizeof(h)); 
             file.read((char*)(&elem_size), sizeof(elem_size));
@@ -180,6 +619,17 @@ class MatrixBase {
             file.read(mem, w * h * elem_size);
             init();
         }
+
+        // rows y to y + n - 1 as they were when the open snapshot was taken, or as they are now
+        virtual void copy_rows(int y, int n, char* out, bool frozen) {
+            const size_t row = (size_t)w * elem_size;
+            if (!frozen) {
+                std::memcpy(out, mem + y * row, n * row);
+                return;
+            }
+            std::lock_guard<std::mutex> lock(log.mutex);
+            log.read(mem, y * row, n * row, out);
+        }
     
         virtual void init() = 0;
         virtual ~MatrixBase() {}
@@ -190,6 +640,21 @@ class MatrixBase {
         int h;
         int elem_size;
         char* mem;
+        PageLog log;
+
+        friend class Snapshot;
+        friend class Database;
+
+        // paged matrices are read into the existing object, like tables, as they own a backing file
+        virtual bool paged() { return false; }
+        virtual void clear() {}
+        virtual int band_rows() { return std::max<int>(1, PageLog::PAGE_SIZE / std::max<size_t>(1, (size_t)w * elem_size)); }
+        virtual void freeze() { log.begin((size_t)w * h * elem_size); }
+        virtual void thaw() { log.end(); }
+        virtual int copied_pages() {
+            std::lock_guard<std::mutex> lock(log.mutex);
+            return log.copied_pages();
+        }
 };
 
 template <typename T>
@@ -210,12 +675,468 @@ class Matrix : public MatrixBase {
         ~Matrix() { delete[] elems; }
         T* begin() const { return elems; }
         T* end() const { return elems + w * h; }
-        inline T& get(short x, short y) { return elems[y * w + x]; }
+        // writes through begin() and elems are not seen by snapshots, get() tells them
+        inline T& get(short x, short y) {
+            if (log.active()) log.before_write(mem, (y * w + x) * sizeof(T), sizeof(T));
+            return elems[y * w + x];
+        }
+        using MatrixBase::read;
+        inline const T& read(short x, short y) const { return elems[y * w + x]; }
         int width() { return w; }
         int height() { return h; }
         T* elems;
 };
 
+// Matrix with 32 bit coordinates in fixed size chunks, which are paged in from a scratch file when
+// accessed. Once more than max_chunks are loaded, the least recently used ones that no focus covers,
+// e.g. the visible tiles, are written back and dropped. Chunks never written hold the fill value.
+// Saved like a Matrix, snapshots copy a chunk when it is first written afterwards.
+template <typename T>
+class ChunkedMatrix : public MatrixBase {
+    public:
+        constexpr static int CHUNK_BITS = 6;
+        constexpr static int CHUNK_SIZE = 1 << CHUNK_BITS;
+        constexpr static int CHUNK_MASK = CHUNK_SIZE - 1;
+        constexpr static int CHUNK_ELEMS = CHUNK_SIZE * CHUNK_SIZE;
+
+        ChunkedMatrix(const std::string& matrix_name, int width, int height, int max_chunks) {
+            name = matrix_name;
+            w = width;
+            h = height;
+            elem_size = sizeof(T);
+            mem = nullptr;
+            file = file_temp();
+            set_max_chunks(max_chunks);
+        }
+
+        ~ChunkedMatrix() {
+            drop();
+            file_close(file);
+        }
+
+        void init() {}
+        int width() { return w; }
+        int height() { return h; }
+        int resident_chunks() { return chunks.size(); }
+        // 0 keeps every chunk resident
+        void set_max_chunks(int max_chunks) {
+            max_resident = max_chunks;
+            next_trim = 0;
+        }
+
+        // the reference stays valid until another chunk is paged in
+        inline T& get(int x, int y) {
+            Chunk& c = chunk(x >> CHUNK_BITS, y >> CHUNK_BITS);
+            if (frozen && !c.copied) copy_frozen(c);
+            c.dirty = true;
+            return c.elems[((y & CHUNK_MASK) << CHUNK_BITS) | (x & CHUNK_MASK)];
+        }
+        using MatrixBase::read;
+        inline const T& read(int x, int y) { return chunk(x >> CHUNK_BITS, y >> CHUNK_BITS).elems[((y & CHUNK_MASK) << CHUNK_BITS) | (x & CHUNK_MASK)]; }
+
+        // the elements from x to the end of its chunk, thread safe while the main thread waits, the
+        // chunk must have been paged in by the last load()
+        inline const T* row(int x, int y) const {
+            return chunks.find(key(x >> CHUNK_BITS, y >> CHUNK_BITS))->second.elems + (((y & CHUNK_MASK) << CHUNK_BITS) | (x & CHUNK_MASK));
+        }
+
+        // pages in x1, y1 to x2, y2 inclusive, wrapped around the size, and keeps it resident until
+        // the next call, also beyond max_chunks
+        void load(int x1, int y1, int x2, int y2) {
+            pin++;
+            const Span xs = span(x1, x2, w);
+            const Span ys = span(y1, y2, h);
+            for (int j = 0; j < ys.n; j++) {
+                for (int cy = ys.first[j]; cy <= ys.last[j]; cy++) {
+                    for (int i = 0; i < xs.n; i++) {
+                        for (int cx = xs.first[i]; cx <= xs.last[i]; cx++) {
+                            chunk(cx, cy).pass = pin;
+                        }
+                    }
+                }
+            }
+            trim();
+        }
+
+        // chunks in the range, which wraps like in load(), are evicted last
+        void set_focus(int id, int x1, int y1, int x2, int y2) { foci[id] = {span(x1, x2, w), span(y1, y2, h)}; }
+        void remove_focus(int id) { foci.erase(id); }
+
+        // sets every element without paging in the chunks, unless a snapshot is open
+        void fill(const T& value) {
+            if (frozen) {
+                for (int y = 0; y < h; y++) {
+                    for (int x = 0; x < w; x++) {
+                        get(x, y) = value;
+                    }
+                }
+                return;
+            }
+            drop();
+            fill_value = value;
+        }
+
+        // like Matrix::read, into the chunks, a band of chunk rows at a time
+        void read(CompressedFile& file) {
+            file.read((char*)(&w), sizeof(w)); 
+            file.read((char*)(&h), sizeof(h)); 
+            file.read((char*)(&elem_size), sizeof(elem_size));
+            clear();
+            std::vector<char> rows((size_t)CHUNK_SIZE * w * sizeof(T));
+            for (int y = 0; y < h; y += CHUNK_SIZE) {
+                const int n = std::min(CHUNK_SIZE, h - y);
+                file.read(rows.data(), n * w * sizeof(T));
+                store_rows(y, n, rows.data());
+            }
+        }
+
+        // rows y to y + n - 1 from the format of copy_rows, y at the start of a chunk
+        void store_rows(int y, int n, const char* in) {
+            for (int cx = 0; cx << CHUNK_BITS < w; cx++) {
+                Chunk& c = chunk(cx, y >> CHUNK_BITS);
+                c.dirty = true;
+                const int cols = std::min(CHUNK_SIZE, w - (cx << CHUNK_BITS));
+                for (int r = 0; r < n; r++) {
+                    std::memcpy(c.elems + (r << CHUNK_BITS), in + ((size_t)r * w + (cx << CHUNK_BITS)) * sizeof(T), cols * sizeof(T));
+                }
+            }
+        }
+
+        // pages nothing in, chunks that are not resident are read from the file
+        void copy_rows(int y, int n, char* out, bool frozen_rows) {
+            std::vector<T> elems(CHUNK_ELEMS);
+            for (int cy = y >> CHUNK_BITS; cy <= (y + n - 1) >> CHUNK_BITS; cy++) {
+                const int first = std::max(y, cy << CHUNK_BITS);
+                const int last = std::min(y + n, (cy + 1) << CHUNK_BITS);
+                for (int cx = 0; cx << CHUNK_BITS < w; cx++) {
+                    copy_chunk(key(cx, cy), elems.data(), frozen_rows);
+                    const int cols = std::min(CHUNK_SIZE, w - (cx << CHUNK_BITS));
+                    for (int r = first; r < last; r++) {
+                        std::memcpy(out + ((size_t)(r - y) * w + (cx << CHUNK_BITS)) * sizeof(T), elems.data() + ((r & CHUNK_MASK) << CHUNK_BITS), cols * sizeof(T));
+                    }
+                }
+            }
+        }
+
+    private:
+        struct Chunk {
+            long long key = 0;
+            T* elems = nullptr;
+            bool dirty = false;
+            bool copied = false; // for the open snapshot
+            long long pass = -1; // of the last load() that covered it
+            std::list<long long>::iterator lru;
+        };
+        // up to two ranges of chunks, as a range wraps around at most once
+        struct Span {
+            int n = 0;
+            int first[2];
+            int last[2];
+        };
+        struct Focus {
+            Span x;
+            Span y;
+        };
+
+        FileHandle file;
+        long long file_end = 0;
+        std::unordered_map<long long, long long> slots; // file offset of every chunk written back so far
+        std::unordered_map<long long, Chunk> chunks;
+        std::list<long long> lru;
+        std::map<int, Focus> foci;
+        int max_resident = 0;
+        int next_trim = 0;
+        long long pin = 0;
+        T fill_value = T();
+        Chunk* last_chunk = nullptr;
+        // only the main thread changes chunks, it locks for that and around the file, so a snapshot
+        // can be written from another thread
+        std::mutex mutex;
+        bool frozen = false;
+        std::unordered_map<long long, std::vector<T>> frozen_copies;
+
+        static long long key(int cx, int cy) { return ((long long)cy << 32) | (unsigned)cx; }
+
+        static Span span(int a, int b, int size) {
+            Span s;
+            const int n = std::min(b - a + 1, size);
+            if (n <= 0) {
+                return s;
+            }
+            const int start = (a % size + size) % size;
+            s.first[0] = start >> CHUNK_BITS;
+            s.last[0] = (std::min(start + n, size) - 1) >> CHUNK_BITS;
+            s.n = 1;
+            if (start + n > size) {
+                s.first[1] = 0;
+                s.last[1] = (start + n - size - 1) >> CHUNK_BITS;
+                s.n = 2;
+            }
+            return s;
+        }
+
+        static bool inside(const Span& s, int c) {
+            for (int i = 0; i < s.n; i++) {
+                if (c >= s.first[i] && c <= s.last[i]) return true;
+            }
+            return false;
+        }
+
+        inline Chunk& chunk(int cx, int cy) {
+            const long long k = key(cx, cy);
+            if (last_chunk && last_chunk->key == k) {
+                return *last_chunk;
+            }
+            return find_chunk(k);
+        }
+
+        Chunk& find_chunk(long long k) {
+            auto it = chunks.find(k);
+            if (it == chunks.end()) {
+                if (max_resident > 0 && (int)chunks.size() >= next_trim) {
+                    trim();
+                }
+                T* elems = new T[CHUNK_ELEMS];
+                std::lock_guard<std::mutex> lock(mutex);
+                auto slot = slots.find(k);
+                if (slot != slots.end()) {
+                    file_seek(file, slot->second);
+                    file_read(file, (char*)elems, CHUNK_ELEMS * sizeof(T));
+                } else {
+                    std::fill(elems, elems + CHUNK_ELEMS, fill_value);
+                }
+                it = chunks.emplace(k, Chunk()).first;
+                Chunk& c = it->second;
+                c.key = k;
+                c.elems = elems;
+                c.copied = frozen_copies.find(k) != frozen_copies.end();
+                lru.push_front(k);
+                c.lru = lru.begin();
+            } else {
+                lru.splice(lru.begin(), lru, it->second.lru);
+            }
+            last_chunk = &it->second;
+            return it->second;
+        }
+
+        // evicts down to max_chunks, unless the rest is pinned or focused, and waits for another
+        // eighth of max_chunks before trying again, so the scan stays cheap while over budget
+        void trim() {
+            auto it = lru.end();
+            while (max_resident > 0 && (int)chunks.size() > max_resident && it != lru.begin()) {
+                --it;
+                auto c = chunks.find(*it);
+                if (c->second.pass == pin || focused(c->second.key)) {
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                write_back(c->second);
+                delete[] c->second.elems;
+                if (last_chunk == &c->second) {
+                    last_chunk = nullptr;
+                }
+                chunks.erase(c);
+                it = lru.erase(it);
+            }
+            next_trim = std::max((int)chunks.size(), max_resident) + std::max(1, max_resident / 8);
+        }
+
+        bool focused(long long k) {
+            const int cx = (int)(k & 0xFFFFFFFF);
+            const int cy = (int)(k >> 32);
+            for (auto& f : foci) {
+                if (inside(f.second.x, cx) && inside(f.second.y, cy)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // called with the mutex held
+        void write_back(Chunk& c) {
+            if (!c.dirty) {
+                return;
+            }
+            auto slot = slots.find(c.key);
+            if (slot == slots.end()) {
+                slot = slots.emplace(c.key, file_end).first;
+                file_end += CHUNK_ELEMS * sizeof(T);
+            }
+            file_seek(file, slot->second);
+            file_write(file, (char*)c.elems, CHUNK_ELEMS * sizeof(T));
+            c.dirty = false;
+        }
+
+        void copy_chunk(long long k, T* out, bool frozen_chunk) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto copy = frozen_copies.find(k);
+            auto it = chunks.find(k);
+            auto slot = slots.find(k);
+            if (frozen_chunk && copy != frozen_copies.end()) {
+                std::copy(copy->second.begin(), copy->second.end(), out);
+            } else if (it != chunks.end()) {
+                std::copy(it->second.elems, it->second.elems + CHUNK_ELEMS, out);
+            } else if (slot != slots.end()) {
+                file_seek(file, slot->second);
+                file_read(file, (char*)out, CHUNK_ELEMS * sizeof(T));
+            } else {
+                std::fill(out, out + CHUNK_ELEMS, fill_value);
+            }
+        }
+
+        void copy_frozen(Chunk& c) {
+            std::lock_guard<std::mutex> lock(mutex);
+            frozen_copies[c.key].assign(c.elems, c.elems + CHUNK_ELEMS);
+            c.copied = true;
+        }
+
+        // every chunk and the file contents
+        void drop() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& c : chunks) {
+                delete[] c.second.elems;
+            }
+            chunks.clear();
+            lru.clear();
+            slots.clear();
+            file_end = 0;
+            last_chunk = nullptr;
+        }
+
+        bool paged() { return true; }
+        void clear() {
+            drop();
+            fill_value = T();
+        }
+        int band_rows() { return CHUNK_SIZE; }
+        void freeze() { frozen = true; }
+        void thaw() {
+            std::lock_guard<std::mutex> lock(mutex);
+            frozen = false;
+            frozen_copies.clear();
+            for (auto& c : chunks) {
+                c.second.copied = false;
+            }
+        }
+        int copied_pages() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return frozen_copies.size();
+        }
+};
+
+// Frozen view of a database that other threads can read while the game keeps changing the live
+// one. Taking it copies only the table indices, rows and matrix elements are copied page by page
+// when they are first written afterwards. Created and released by the database on its thread.
+class Snapshot {
+    public:
+        // same format as Database::write
+        void write(const std::string& filename) {
+            CompressedFile file(filename, true);
+            int namesize = name.size();
+            file.write((char*)(&namesize), sizeof(namesize)); 
+            file.write(name.c_str(), name.size());
+            int numTables = tables.size();
+            file.write((char*)(&numTables), sizeof(numTables)); 
+            for (auto& t : tables) {
+                write_table(file, t);
+            }
+            int numMatrices = matrices.size();
+            file.write((char*)(&numMatrices), sizeof(numMatrices)); 
+            for (auto& m : matrices) {
+                m.second->write(file, true);
+            }
+        }
+
+        // calls f with the key and a copy of every row
+        template <typename T, typename F>
+        void rows(const std::string& table_name, F f) {
+            for (auto& t : tables) {
+                if (t.name != table_name) continue;
+                std::vector<char> data = copy_rows(t);
+                for (size_t i = 0; i < t.entries.size(); i++) {
+                    f(t.entries[i].key, *(const T*)(data.data() + i * t.elem_size));
+                }
+            }
+        }
+
+        // copies rows y to y + n - 1 of a matrix
+        template <typename T>
+        void matrix_rows(const std::string& matrix_name, int y, int n, T* out) {
+            for (auto& m : matrices) {
+                if (m.first == matrix_name) m.second->copy_rows(y, n, (char*)out, true);
+            }
+        }
+
+        // pages copied since the snapshot was taken, only writes copy them
+        int copied_pages() {
+            int n = 0;
+            for (auto& t : tables) {
+                std::lock_guard<std::mutex> lock(t.table->log.mutex);
+                n += t.table->log.copied_pages();
+            }
+            for (auto& m : matrices) {
+                n += m.second->copied_pages();
+            }
+            return n;
+        }
+
+    private:
+        struct FrozenTable {
+            std::string name;
+            TableBase* table;
+            std::vector<KeyIndex::Entry> entries;
+            int elem_size;
+        };
+        std::string name;
+        std::vector<FrozenTable> tables;
+        std::vector<std::pair<std::string, MatrixBase*>> matrices;
+
+        friend class Database;
+
+        void freeze(const std::string& table_name, TableBase* table) {
+            tables.push_back({table_name, table, std::vector<KeyIndex::Entry>(table->index.begin(), table->index.end()), table->elem_size});
+            table->log.begin(table->mem.size());
+        }
+
+        void freeze(const std::string& matrix_name, MatrixBase* matrix) {
+            matrices.push_back({matrix_name, matrix});
+            matrix->freeze();
+        }
+
+        void release() {
+            for (auto& t : tables) t.table->log.end();
+            for (auto& m : matrices) m.second->thaw();
+        }
+
+        std::vector<char> copy_rows(FrozenTable& t) {
+            std::vector<char> data(t.entries.size() * t.elem_size);
+            std::lock_guard<std::mutex> lock(t.table->log.mutex);
+            for (size_t i = 0; i < t.entries.size(); i++) {
+                t.table->log.read(t.table->mem.data(), t.entries[i].offset, t.elem_size, data.data() + i * t.elem_size);
+            }
+            return data;
+        }
+
+        // like TableBase::write after a vacuum
+        void write_table(CompressedFile& file, FrozenTable& t) {
+            std::vector<char> data = copy_rows(t);
+            int namesize = t.name.size();
+            file.write((char*)(&namesize), sizeof(namesize)); 
+            file.write(t.name.c_str(), t.name.size());
+            int nRows = t.entries.size();
+            file.write((char*)(&nRows), sizeof(nRows)); 
+            for (int i = 0; i < nRows; i++) {
+                int offset = i * t.elem_size;
+                file.write((char*)(&t.entries[i].key), sizeof(t.entries[i].key)); 
+                file.write((char*)(&offset), sizeof(offset)); 
+            }
+            int nDeleted = 0;
+            file.write((char*)(&nDeleted), sizeof(nDeleted)); 
+            file.write((char*)(&t.elem_size), sizeof(t.elem_size)); 
+            file.write(data.data(), data.size());
+        }
+};
+
 class Database {
     public:
         Database(const std::string& db_name): name(db_name) {}
@@ -226,6 +1147,8 @@ class Database {
            return get_table<T>(table_name);
         }
 
+        // the table lives as long as the database, also across read(), so the pointer can be
+        // resolved once and kept as a handle instead of looking the name up on every access
         template <typename T>
         Table<T>* get_table(const std::string& table_name) {
            if (tables.find(table_name) != tables.end()) {
@@ -233,6 +1156,14 @@ class Database {
            }
            return create_table<T>(table_name);
         }
+
+        // tables are created with a sorted index, read ones are converted on their first use
+        template <typename T>
+        Table<T>* get_table(const std::string& table_name, KeyIndex::Type index_type) {
+           Table<T>* table = get_table<T>(table_name);
+           table->set_index_type(index_type);
+           return table;
+        }
         
         template <typename T>
         Matrix<T>* create_matrix(const std::string& matrix_name, int width, int height) {
@@ -248,6 +1179,62 @@ class Database {
            return create_matrix<T>(matrix_name, width, height);
         }
 
+        // like get_matrix(), max_chunks is also applied to an existing one, and a Matrix of that name,
+        // e.g. read before the chunked one was created, is moved into it
+        template <typename T>
+        ChunkedMatrix<T>* get_chunked_matrix(const std::string& matrix_name, int width, int height, int max_chunks) {
+            auto it = matrices.find(matrix_name);
+            if (it != matrices.end() && it->second->paged()) {
+                ChunkedMatrix<T>* matrix = static_cast<ChunkedMatrix<T>*>(it->second);
+                matrix->set_max_chunks(max_chunks);
+                return matrix;
+            }
+            if (it == matrices.end()) {
+                ChunkedMatrix<T>* matrix = new ChunkedMatrix<T>(matrix_name, width, height, max_chunks);
+                matrices.insert(std::make_pair(matrix_name, matrix));
+                return matrix;
+            }
+            MatrixBase* old = it->second;
+            ChunkedMatrix<T>* matrix = new ChunkedMatrix<T>(matrix_name, old->w, old->h, max_chunks);
+            constexpr int band = ChunkedMatrix<T>::CHUNK_SIZE;
+            std::vector<char> rows((size_t)band * old->w * old->elem_size);
+            for (int y = 0; y < old->h; y += band) {
+                const int n = std::min(band, old->h - y);
+                old->copy_rows(y, n, rows.data(), false);
+                matrix->store_rows(y, n, rows.data());
+            }
+            delete old;
+            it->second = matrix;
+            return matrix;
+        }
+
+        // the next get_matrix() creates it anew, e.g. with a different size
+        void remove_matrix(const std::string& matrix_name) {
+            auto it = matrices.find(matrix_name);
+            if (it != matrices.end()) {
+                delete it->second;
+                matrices.erase(it);
+            }
+        }
+
+        // one snapshot can be open at a time, until it is released the database must not be read
+        // and matrices not removed
+        Snapshot* snapshot() {
+            if (open_snapshot) return nullptr;
+            open_snapshot = new Snapshot();
+            open_snapshot->name = name;
+            for (auto& t : tables) open_snapshot->freeze(t.first, t.second);
+            for (auto& m : matrices) open_snapshot->freeze(m.first, m.second);
+            return open_snapshot;
+        }
+
+        // after the readers of the snapshot are done
+        void release(Snapshot* snapshot) {
+            snapshot->release();
+            delete snapshot;
+            open_snapshot = nullptr;
+        }
+
         void write(const std::string& filename) {
             CompressedFile file(filename, true);
             int namesize = name.size();
@@ -265,11 +1252,18 @@ class Database {
             } 
         }
         
+        // tables and paged matrices are read into the existing objects to keep their handles valid
         void read(const std::string& filename) {
-            for (auto item : tables) delete item.second;
-            for (auto item : matrices) delete item.second;
-            tables.clear();
-            matrices.clear();
+            for (auto item : tables) item.second->clear();
+            for (auto it = matrices.begin(); it != matrices.end(); ) {
+                if (it->second->paged()) {
+                    it->second->clear();
+                    ++it;
+                } else {
+                    delete it->second;
+                    it = matrices.erase(it);
+                }
+            }
             CompressedFile file(filename, false);
             int namesize = -1;
             file.read((char*)(&namesize), sizeof(namesize));
@@ -282,7 +1276,9 @@ class Database {
                 file.read((char*)(&namesize), sizeof(namesize)); 
                 table_name.resize(namesize);
                 file.read(&table_name[0], table_name.size());
-                create_table<char>(table_name)->read(file);
+                auto it = tables.find(table_name);
+                TableBase* table = it != tables.end() ? it->second : create_table<char>(table_name);
+                table->read(file);
             }
             int numMatrices = -1;
             file.read((char*)(&numMatrices), sizeof(numMatrices)); 
@@ -291,7 +1287,9 @@ class Database {
                 file.read((char*)(&namesize), sizeof(namesize)); 
                 matrix_name.resize(namesize);
                 file.read(&matrix_name[0], matrix_name.size());
-                create_matrix<char>(matrix_name, 0, 0)->read(file);
+                auto it = matrices.find(matrix_name);
+                MatrixBase* matrix = it != matrices.end() ? it->second : create_matrix<char>(matrix_name, 0, 0);
+                matrix->read(file);
             }
         }
 
@@ -299,6 +1297,7 @@ class Database {
         std::map<std::string, TableBase*> tables;
         std::map<std::string, MatrixBase*> matrices;
         std::string name;
+        Snapshot* open_snapshot = nullptr;
 };
 
 #endif
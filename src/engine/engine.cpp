@@ -8,15 +8,48 @@
 #include "audio.h"
 #include "sim.h"
 #include "scene.h"
+#include "profiler.h"
 
 GameEngine Engine;
 
+// environment variables override settings, so unattended runs need no config changes
+static std::string setting_or_env(const std::string& key, const char* env) {
+    const char* value = getenv(env);
+    auto& settings = Engine.config("settings");
+    return value ? value : settings.contains(key) ? settings[key].s() : "";
+}
+
 GameEngine::GameEngine() {}
 
 void GameEngine::init() {
     Engine.register_script_function({"set_config", {ScriptType::STRING, ScriptType::TABLE}, [&](const std::vector<ScriptParam>& params) { m_configs[params[0].s()] = params[1]; return 0; }});
     execute_script("scripts/config.lua");
     Engine.register_script_function({"Engine_load_state", {ScriptType::STRING}, [&](const std::vector<ScriptParam>& params) { load_state(params[0].s()); return 0; }});
+    m_profiler = new Profiler();
+    Engine.register_script_function({"Engine_profiler_graph", {}, [&](const std::vector<ScriptParam>&) {
+        m_profiler->show_graph(!m_profiler->showing_graph()); return 0;
+    }});
+    Engine.register_script_function({"Engine_profiler_csv", {ScriptType::STRING}, [&](const std::vector<ScriptParam>& params) {
+        return (int)m_profiler->write_csv(params[0].s());
+    }});
+    Engine.register_script_function({"Engine_profiler_trace", {ScriptType::STRING}, [&](const std::vector<ScriptParam>& params) {
+        return (int)m_profiler->write_trace(params[0].s());
+    }});
+    Engine.register_script_function({"Engine_profiler_stats", {}, [&](const std::vector<ScriptParam>&) {
+        std::map<ScriptParam, ScriptParam> ret;
+        std::vector<std::string> names = m_profiler->phase_names();
+        names.push_back("frame");
+        for (auto& name : names) {
+            Profiler::Stats s = m_profiler->stats(name == "frame" ? "" : name);
+            std::map<ScriptParam, ScriptParam> phase;
+            phase["p50"] = s.p50; phase["p95"] = s.p95; phase["p99"] = s.p99;
+            ret[name] = phase;
+        }
+        return ret;
+    }});
+    Engine.register_script_function({"Engine_screenshot", {ScriptType::STRING}, [&](const std::vector<ScriptParam>& params) {
+        return (int)m_screen->write_frame(params[0].s());
+    }});
 
     Size resolution(m_configs["settings"]["resolution"]["width"].i(), m_configs["settings"]["resolution"]["height"].i());
     m_db = new Database("database");
@@ -29,13 +62,46 @@ void GameEngine::init() {
     m_scenes = new ScenePlayer();
 
     m_screen->init_script_api();
+
+    const std::string record_path = setting_or_env("record_input", "ENGINE_RECORD_INPUT");
+    const std::string replay_path = setting_or_env("replay_input", "ENGINE_REPLAY_INPUT");
+    if (!replay_path.empty()) {
+        m_input->replay(replay_path);
+    } else if (!record_path.empty()) {
+        m_input->record(record_path);
+        atexit([]() { Engine.input()->stop_recording(); });
+    }
 }
         
 void GameEngine::save_state(const std::string& filename) {
-    m_db->write(filename);
+    finish_save();
+    m_map->finish_map();
+    Snapshot* snapshot = m_db->snapshot();
+    save_snapshot = snapshot;
+    saved = false;
+    save_thread = std::thread([this, snapshot, filename]() {
+        snapshot->write(filename);
+        saved = true;
+    });
+    // registered after the job system started, so it runs before the workers are torn down
+    static bool wait_at_exit = false;
+    if (!wait_at_exit) {
+        atexit([]() { Engine.finish_save(); });
+        wait_at_exit = true;
+    }
+}
+
+void GameEngine::finish_save() {
+    if (!save_snapshot) {
+        return;
+    }
+    save_thread.join();
+    m_db->release(save_snapshot);
+    save_snapshot = nullptr;
 }
  
 void GameEngine::load_state(const std::string& filename) {
+    finish_save();
     if (file_exists("state.sav")) {
         m_db->read(filename);
         m_textures->reinit();
@@ -48,24 +114,230 @@ void GameEngine::register_script_function(const ScriptFunction& function) { add_
 void GameEngine::execute_script(const std::string& filepath) { run_script(filepath); }
 
 void GameEngine::run() {
+    auto& settings = m_configs["settings"];
+    const int target_fps = settings.contains("target_fps") ? settings["target_fps"].i() : 60;
+    // 0 keeps the game turn based, games that run in real time opt in with a step rate
+    const int sim_rate = settings.contains("sim_steps_per_second") ? settings["sim_steps_per_second"].i() : 0;
+    const int idle_timeout = 1000 * (settings.contains("idle_timeout_ms") ? settings["idle_timeout_ms"].i() : 500);
+    const long long frame_time = target_fps > 0 ? 1000 * 1000 / target_fps : 0;
+    const long long sim_time = sim_rate > 0 ? 1000 * 1000 / sim_rate : 0;
+    constexpr int MAX_SIM_STEPS = 4; // per frame, the backlog is dropped after a stall
+    // for unattended runs, ENGINE_DUMP_FRAMES and ENGINE_MAX_FRAMES override the settings
+    const std::string dump_frames = setting_or_env("dump_frames", "ENGINE_DUMP_FRAMES");
+    const char* max_env = getenv("ENGINE_MAX_FRAMES");
+    const long long max_frames = max_env ? atoll(max_env) : settings.contains("max_frames") ? settings["max_frames"].i() : 0;
+    long long frame = 0;
+    long long next_frame = now();
+    long long next_sim_step = now() + sim_time;
+
     while(1) {
-        m_scenes->handle_scenes();
-        m_input->handleInputs();
-        m_screen->draw();
-        m_screen->update();
+        m_profiler->begin_frame();
+        frame_requested = false;
+        {
+            Profiler::Scope scope("handle_scenes");
+            m_scenes->handle_scenes();
+        }
+        {
+            Profiler::Scope scope("handleInputs");
+            m_input->handleInputs();
+        }
+        // while recording or replaying the steps follow the frame count instead of the clock,
+        // so a replay reaches the same state as the recorded run
+        const bool frame_steps = m_input->recording() || m_input->replaying();
+        if (sim_time && frame_steps) {
+            Profiler::Scope scope("simulation");
+            const long long f = m_input->frames();
+            const int frame_rate = target_fps > 0 ? target_fps : sim_rate;
+            const long long steps = f * sim_rate / frame_rate - (f - 1) * sim_rate / frame_rate;
+            for (long long i = 0; i < steps; i++) {
+                m_sim->step(1);
+            }
+            next_sim_step = now() + sim_time;
+        } else if (sim_time) {
+            Profiler::Scope scope("simulation");
+            for (int i = 0; i < MAX_SIM_STEPS && now() >= next_sim_step; i++) {
+                m_sim->step(1);
+                next_sim_step += sim_time;
+            }
+            next_sim_step = std::max(next_sim_step, now());
+        }
+        // the previous frame was copied to the window meanwhile
+        m_screen->show_presented();
+        {
+            Profiler::Scope scope("draw");
+            m_screen->draw();
+        }
+        if (!dump_frames.empty()) {
+            Profiler::Scope scope("dump_frame");
+            std::string path = dump_frames;
+            replace(path, "%d", std::to_string(frame));
+            m_screen->write_frame(path);
+        }
+        m_screen->present();
+        frame++;
+        if (max_frames && frame >= max_frames) {
+            m_screen->finish_present();
+            exit(0);
+        }
+        {
+            Profiler::Scope scope("trim");
+            m_textures->trim();
+        }
+        if (save_snapshot && saved) {
+            finish_save(); // pages are no longer copied on write
+        }
+        m_profiler->end_frame();
+
+        // sleep until the next frame, or until the next input event if nothing is going on
+        bool busy = frame_requested || m_input->active() || m_scenes->current_scene || m_profiler->showing_graph()
+            || (sim_time && frame_steps && m_sim->running());
+        long long t = now();
+        if (!busy) {
+            m_screen->finish_present(); // the last frame is shown before waiting for input
+            long long timeout = sim_time && m_sim->running() ? next_sim_step - t : idle_timeout;
+            if (timeout > 0) {
+                wait_events(std::min<long long>(timeout, idle_timeout));
+            }
+            next_frame = now();
+        } else if (frame_time) {
+            next_frame = std::max(next_frame + frame_time, t);
+            if (next_frame > t) {
+                wait(next_frame - t);
+            }
+        }
+    }
+}
+
+void Screen::present() {
+    {
+        Profiler::Scope scope("present");
+        if (!present_thread.joinable()) {
+            if (!headless) {
+                copy_to_surface(current, frame_changes);
+                show_frame();
+            }
+        } else {
+            show_copied(in_flight - 1);
+            std::unique_lock<std::mutex> lock(present_mutex);
+            buffer_busy[current] = true;
+            submitted++;
+            present_queue.push_back({current, frame_changes});
+            cv_present.notify_all();
+        }
+        if (buffers.size() > 1) {
+            const int last = current;
+            for (int i = 0; i < (int)buffers.size(); i++) {
+                for (auto& b : frame_changes) {
+                    if (i != last) {
+                        add_damage(stale[i], b);
+                    }
+                }
+            }
+            current = (current + 1) % buffers.size();
+            {
+                std::unique_lock<std::mutex> lock(present_mutex);
+                cv_present.wait(lock, [this]() { return !buffer_busy[current]; });
+            }
+            // the buffer holds an older frame, the areas changed since then are taken from the last one
+            copy_rects(buffers[last], buffers[current], stale[current]);
+            stale[current].clear();
+            pixels = buffers[current];
+        }
+        frame_changes.clear();
+    }
+    long long t_now = now();
+    long long t = t_now - last_update;
+    m_fps = t > 0 ? (1000 * 1000) / t : 0;
+    last_update = t_now;
+}
+
+void Screen::show_copied(int max_outstanding) {
+    if (!present_thread.joinable()) {
+        return;
+    }
+    int done = 0;
+    {
+        std::unique_lock<std::mutex> lock(present_mutex);
+        cv_present.wait(lock, [&]() { return submitted - copied <= max_outstanding; });
+        done = copied;
+    }
+    // a frame copied over before it was shown is skipped
+    if (done > shown) {
+        shown = done;
+        show_frame();
+    }
+}
+
+void Screen::stop_present() {
+    if (!present_thread.joinable()) {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(present_mutex);
+        stop_presenting = true;
+    }
+    cv_present.notify_all();
+    present_thread.join();
+}
+
+// only copies buffers, the window is updated from the main thread
+void Screen::present_loop() {
+    while (true) {
+        Submission s;
+        {
+            std::unique_lock<std::mutex> lock(present_mutex);
+            cv_present.wait(lock, [this]() { return !present_queue.empty() || stop_presenting; });
+            if (present_queue.empty()) {
+                return;
+            }
+            s = present_queue.front();
+            present_queue.pop_front();
+        }
+        copy_to_surface(s.buffer, s.changes);
+        {
+            std::unique_lock<std::mutex> lock(present_mutex);
+            buffer_busy[s.buffer] = false;
+            copied++;
+        }
+        cv_present.notify_all();
+    }
+}
+
+// the window surface keeps the last frame, only the changed areas and the profiler graph are copied
+void Screen::copy_to_surface(int buffer, std::vector<Box> changes) {
+    std::lock_guard<std::mutex> lock(surface_mutex);
+    if (graph_box.a.x != graph_box.b.x) {
+        add_damage(changes, graph_box);
+        graph_box = Box();
+    }
+    copy_rects(buffers[buffer], surface, changes);
+}
+
+void Screen::show_frame() {
+    std::lock_guard<std::mutex> lock(surface_mutex);
+    if (Engine.profiler()->showing_graph()) {
+        graph_box = Engine.profiler()->draw_graph((unsigned*)surface, size);
+    }
+    update_window();
+}
+
+void Screen::copy_rects(const int* src, int* dst, const std::vector<Box>& rects) {
+    for (auto& r : rects) {
+        for (int y = r.a.y; y < r.b.y; y++) {
+            std::memcpy(dst + y * size.w + r.a.x, src + y * size.w + r.a.x, (r.b.x - r.a.x) * sizeof(int));
+        }
     }
 }
 
 void Composite::set_overlay(Color color, int num_frames, Listener* listener) {
     overlay_listener = listener;
-    if (!m_overlay) {
-        m_overlay = new Texture((unsigned)0x0, size);
-        m_overlay->set_transparent(true);
-    }
     Color target_color;
     target_color = color;
     Color old_color;
-    old_color = static_cast<unsigned>(m_overlay->pixels()[0]); 
+    if (has_overlay) {
+        old_color = overlay_color;
+    }
+    has_overlay = true;
     for (int i = num_frames; i > 0; i--) {
         Color new_color = old_color;
         new_color.red += ((double)i / num_frames) * (target_color.red - old_color.red);
@@ -74,6 +346,72 @@ void Composite::set_overlay(Color color, int num_frames, Listener* listener) {
         new_color.alpha += ((double)i / num_frames) * (target_color.alpha - old_color.alpha);
         overlay_colors.push_back(new_color);
     }
+    set_update(true);
+}
+
+void Composite::set_update(bool update) {
+    dirty = update;
+    if (update) {
+        for (Composite* c = this; c; c = c->parent) {
+            c->layer_dirty = true;
+        }
+    }
+    // before the first draw the composite is not on the screen yet, add_child damages its area
+    if (update && initialized) {
+        Engine.screen()->damage(Box(pos, size));
+    }
+}
+
+void Composite::add_child(Composite* child, Point offset) {
+    child->pos = pos + offset;
+    child->parent = this;
+    child->invalidate();
+    child->set_update(true);
+    Engine.screen()->damage(Box(child->pos, child->size));
+    children.push_back(child);
+}
+
+void Composite::remove_child(Composite* child) {
+    children.erase(std::remove(children.begin(), children.end(), child), children.end());
+    child->parent = nullptr;
+    for (Composite* c = this; c; c = c->parent) {
+        c->layer_dirty = true;
+    }
+    Engine.screen()->damage(Box(child->pos, child->size));
+}
+
+void Composite::render() {
+    if (!layered) {
+        draw();
+        return;
+    }
+    std::vector<Box> boxes = repaint_boxes();
+    if (!layer) {
+        layer = new int[size.w * size.h]();
+        layer_dirty = true;
+        dirty = true;
+        boxes = {Box(pos, size)};
+    }
+    if (layer_dirty) {
+        layer_dirty = false;
+        Engine.screen()->push_target(layer, Box(pos, size));
+        draw();
+        Engine.screen()->pop_target();
+    }
+    for (auto& clip : boxes) {
+        Engine.screen()->blit((Color*)layer, size, pos, clip, false);
+    }
+}
+
+bool Composite::needs_update() {
+    return dirty || Engine.screen()->is_damaged(Box(pos, size));
+}
+
+std::vector<Box> Composite::repaint_boxes() {
+    if (dirty) {
+        return {Box(pos, size)};
+    }
+    return Engine.screen()->damaged(Box(pos, size));
 }
 
 void Composite::draw() {
@@ -81,32 +419,47 @@ void Composite::draw() {
         init();
         initialized = true;
     }
-    if (needs_update() && m_texture) {
-        Engine.screen()->blit(m_texture->pixels(), m_texture->size(), pos, Box(pos, size), m_texture->transparent());
-        set_update(false);
-    }
-    for (auto& child : children) {
-        child->draw();
-    }
-    if (!overlay_colors.empty()) {
+    const bool fading = !overlay_colors.empty();
+    if (fading) {
         Color new_color;
         new_color = overlay_colors.back();
         new_color.alpha = overlay_colors.back().alpha; // to make static analysis shut up
-        Color* pixels = m_overlay->pixels();
-        std::fill(pixels, pixels + m_overlay->size().w * m_overlay->size().h, int(new_color));
+        overlay_color = new_color;
         overlay_colors.pop_back();
-        if (overlay_colors.empty()) {
-            if (new_color.alpha == 0) {
-                delete m_overlay;
-                m_overlay = nullptr;
+        set_update(true);
+    }
+    const std::vector<Box> boxes = repaint_boxes();
+    if (!boxes.empty()) {
+        if (m_texture) {
+            for (auto& clip : boxes) {
+                Engine.screen()->blit(m_texture->pixels(), m_texture->size(), pos, clip, m_texture->transparent());
+            }
+        }
+        dirty = false;
+    }
+    for (auto& child : children) {
+        if (profile_children) {
+            Profiler::Scope scope(child->profile_name());
+            child->render();
+        } else {
+            child->render();
+        }
+    }
+    if (has_overlay) {
+        for (auto& clip : boxes) {
+            Engine.screen()->blend_color(overlay_color, clip);
+        }
+    }
+    if (fading) {
+        if (!overlay_colors.empty()) {
+            Engine.request_frame();
+        } else {
+            if (overlay_color.alpha == 0) {
+                has_overlay = false;
             }
             if (overlay_listener) {
                 overlay_listener->fade_completed(this);
             }
         }
     }
-    if (m_overlay) {
-        Engine.screen()->blit(m_overlay->pixels(), m_overlay->size(), pos, Box(pos, size), true);
-        set_update(true);
-    }
 }
\ No newline at end of file
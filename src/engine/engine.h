@@ -10,8 +10,12 @@ class Screen;
 class AudioPlayer;
 class Simulation;
 class ScenePlayer;
+class Profiler;
+class Snapshot;
 
 #include "util.h"
+#include <thread>
+#include <atomic>
 
 class GameEngine {
     public:
@@ -19,6 +23,7 @@ class GameEngine {
         void init();
         void run();
 
+        // the file is written in the background from a snapshot, while the game goes on
         void save_state(const std::string& filename);
         void load_state(const std::string& filename);
 
@@ -33,7 +38,10 @@ class GameEngine {
         AudioPlayer* audio() { return m_audio; }
         Simulation* sim() { return m_sim; }
         ScenePlayer* scenes() { return m_scenes; }
+        Profiler* profiler() { return m_profiler; }
         ScriptParam& config(const std::string& name) { return m_configs[name]; }
+        // keeps the main loop running at the target frame rate for one more frame, e.g. during animations
+        void request_frame() { frame_requested = true; }
 
     private:
         Input* m_input = nullptr;
@@ -44,7 +52,15 @@ class GameEngine {
         AudioPlayer* m_audio = nullptr;
         Simulation* m_sim = nullptr;
         ScenePlayer* m_scenes = nullptr;
+        Profiler* m_profiler = nullptr;
         std::map<std::string, ScriptParam> m_configs;
+        bool frame_requested = true;
+        Snapshot* save_snapshot = nullptr;
+        // a thread of its own, a job could be picked up by the main thread waiting for other work
+        std::thread save_thread;
+        std::atomic<bool> saved{false};
+
+        void finish_save();
 };
 
 extern GameEngine Engine;
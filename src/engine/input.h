@@ -2,6 +2,7 @@
 #define INPUT_H
 
 #include "util.h"
+#include "db.h"
 
 class Input {
     public:
@@ -38,11 +39,81 @@ class Input {
             }
         }
         bool shift_held() { return shift_active; }
+        // whether the last handleInputs() saw any keys, clicks or mouse movement, always while replaying
+        bool active() { return had_input || replay_file; }
+        // the live mouse position, or the recorded one while replaying
+        Point mouse() { return mouse_position; }
+
+        // writes the random seed and every consumed event with its frame, until stop_recording(),
+        // meanwhile the simulation steps with the frame count so the replay ends in the same state
+        bool record(const std::string& path) {
+            stop_recording();
+            record_file = new CompressedFile(path, true);
+            frame = 0;
+            set_random_seed(random_seed()); // the replay starts from the same generator state
+            unsigned seed = random_seed();
+            record_file->write(RECORD_MAGIC, 4);
+            record_file->write((char*)&RECORD_VERSION, sizeof(RECORD_VERSION));
+            record_file->write((char*)&seed, sizeof(seed));
+            return true;
+        }
+
+        void stop_recording() {
+            if (record_file) {
+                const int end = -1;
+                record_file->write((char*)&end, sizeof(end));
+                delete record_file;
+                record_file = nullptr;
+            }
+        }
+
+        // feeds a recording back frame by frame, live events are drained and ignored
+        bool replay(const std::string& path) {
+            if (!file_exists(path)) {
+                return false;
+            }
+            delete replay_file;
+            replay_file = new CompressedFile(path, false);
+            char magic[4];
+            int version = 0;
+            unsigned seed = 0;
+            replay_file->read(magic, 4);
+            replay_file->read((char*)&version, sizeof(version));
+            if (std::memcmp(magic, RECORD_MAGIC, 4) != 0 || version != RECORD_VERSION) {
+                print("not an input recording: " + path);
+                delete replay_file;
+                replay_file = nullptr;
+                return false;
+            }
+            replay_file->read((char*)&seed, sizeof(seed));
+            set_random_seed(seed);
+            if (!replay_file->read((char*)&replay_frame, sizeof(replay_frame))) {
+                replay_frame = -1;
+            }
+            frame = 0;
+            return true;
+        }
+        bool replaying() { return replay_file; }
+        bool recording() { return record_file; }
+        // frames since recording or replaying started
+        int frames() { return frame; }
 
         void handleInputs() {
             std::vector<std::string> pressed;
             std::vector<std::string> released;
             pressed_keys(pressed, released);
+            Point current_mouse_pos = mouse_pos();
+            if (replay_file) {
+                pressed.clear();
+                released.clear();
+                current_mouse_pos = mouse_position;
+                read_frame(pressed, released, current_mouse_pos);
+            }
+            if (record_file && (!pressed.empty() || !released.empty() || current_mouse_pos != mouse_position)) {
+                write_frame(pressed, released, current_mouse_pos);
+            }
+            mouse_position = current_mouse_pos;
+            frame++;
             for (auto& hold : held) {
                 pressed.push_back(hold.first);
             }
@@ -55,7 +126,7 @@ class Input {
                         held[key] = 1;
                     }
                 } else if (key == "MouseLeft") {
-                    Point p = mouse_pos();
+                    Point p = mouse_position;
                     std::map<Input::Listener*, Box>& active_clicks = enabled ? clicks : temp_clicks;
                     for (auto& click : active_clicks) {
                         auto& box = click.second;
@@ -76,7 +147,7 @@ class Input {
                 }
                 held.erase(key);
             }
-            Point current_mouse_pos = mouse_pos();
+            had_input = !pressed.empty() || !released.empty() || current_mouse_pos != last_mouse_pos;
             if (enabled && current_mouse_pos != last_mouse_pos) {
                 for (auto& l : mouse_moves) {
                     l->mouse_moved(current_mouse_pos);
@@ -95,6 +166,64 @@ class Input {
         }
 
     private:
+        constexpr static const char* RECORD_MAGIC = "INPT";
+        constexpr static int RECORD_VERSION = 2;
+        CompressedFile* record_file = nullptr;
+        CompressedFile* replay_file = nullptr;
+        int frame = 0;
+        int replay_frame = -1; // frame of the next recorded events, -1 at the end
+        Point mouse_position;
+
+        // per frame with events: frame, mouse position, pressed and released keys
+        void write_frame(const std::vector<std::string>& pressed, const std::vector<std::string>& released, Point mouse) {
+            record_file->write((char*)&frame, sizeof(frame));
+            record_file->write((char*)&mouse, sizeof(mouse));
+            for (auto keys : {&pressed, &released}) {
+                unsigned char num_keys = std::min<int>(keys->size(), 255);
+                record_file->write((char*)&num_keys, 1);
+                for (int i = 0; i < num_keys; i++) {
+                    unsigned char len = std::min<int>((*keys)[i].size(), 255);
+                    record_file->write((char*)&len, 1);
+                    record_file->write((*keys)[i].c_str(), len);
+                }
+            }
+        }
+
+        // a recording without the -1 terminator, cut off by a crash, ends after its last complete frame
+        void read_frame(std::vector<std::string>& pressed, std::vector<std::string>& released, Point& mouse) {
+            while (replay_frame >= 0 && replay_frame <= frame) {
+                Point recorded_mouse;
+                std::vector<std::string> recorded[2];
+                bool complete = replay_file->read((char*)&recorded_mouse, sizeof(recorded_mouse));
+                for (auto& keys : recorded) {
+                    unsigned char num_keys = 0;
+                    complete = complete && replay_file->read((char*)&num_keys, 1);
+                    for (int i = 0; complete && i < num_keys; i++) {
+                        unsigned char len = 0;
+                        complete = replay_file->read((char*)&len, 1);
+                        std::string key(len, ' ');
+                        complete = complete && replay_file->read(&key[0], len);
+                        keys.push_back(key);
+                    }
+                }
+                if (!complete) {
+                    replay_frame = -1;
+                    break;
+                }
+                mouse = recorded_mouse;
+                pressed.insert(pressed.end(), recorded[0].begin(), recorded[0].end());
+                released.insert(released.end(), recorded[1].begin(), recorded[1].end());
+                if (!replay_file->read((char*)&replay_frame, sizeof(replay_frame))) {
+                    replay_frame = -1;
+                }
+            }
+            if (replay_frame < 0) {
+                print("replay finished after " + std::to_string(frame) + " frames");
+                delete replay_file;
+                replay_file = nullptr;
+            }
+        }
+
         std::map<std::string, int> held;
         std::vector<Input::Listener*> mouse_moves;
         std::map<std::string, Input::Listener*> temp_presses;
@@ -105,6 +234,7 @@ class Input {
         bool enabled = true;
         bool clear_temps = false;
         bool shift_active = false;
+        bool had_input = true;
         Point last_mouse_pos;
 };
 
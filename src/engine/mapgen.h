@@ -12,7 +12,7 @@ class MapGen {
           public:
             struct Item {
                 Item(const std::string& n, double p): name(n), perc(p) {}
-                Size size() { return m_size; }
+                Size size() const { return m_size; }
                 Texture::ID id() {
                     if (m_id < 0) {
                         Texture* t = Engine.textures()->get(name);
@@ -84,10 +84,63 @@ class MapGen {
             short sample_distance = 0;
         };
 
-        static void post_process(Config& config, Size map_size) {
-            auto map = Engine.map();
-            std::map<Texture::ID, std::map<Texture::ID, int>> blend_map; 
-            std::map<Texture::ID, std::string> name_map; 
+        struct Anchor {
+            static constexpr int PERC_FACTOR = 100000;
+            Anchor(Point p, double pc, char t): pos(p), perc(PERC_FACTOR * pc), temp(t) {}
+            Point pos;
+            long long perc;
+            char temp;
+        };
+
+        constexpr static int CHUNK_TILES = 64;
+
+        // generated tiles of one chunk, textures that may not exist yet are given by name
+        struct Chunk {
+            Point pos;
+            Size size;
+            std::vector<Texture::ID> ground; // negative if blocked
+            std::vector<short> names; // index into texture_names instead of the ground id, or -1
+            std::vector<std::string> texture_names;
+            std::vector<std::pair<Point, const Config::Item*>> items; // by root tile, may reach into the next chunks
+            Point end; // below and right of everything apply() changes
+        };
+
+        // anchors and textures are set up on the main thread, generate() then only depends on them
+        MapGen(Size map_size, Size tile_dim): map_size(map_size), tile_dim(tile_dim) {
+            for (auto& elevation : config.elevations) {
+                for (auto& biome : elevation.biomes) {
+                    biome.id();
+                    for (auto& item : biome.items) {
+                        item.id();
+                        Size s = item.size() / tile_dim;
+                        item_reach = std::max<int>(item_reach, std::max(s.w, s.h));
+                    }
+                }
+            }
+            mountain_biome = &config.elevations.back().biomes[0];
+            wall_id = Engine.textures()->get(mountain_biome->name_wall)->id();
+            max_height = mountain_biome->max_height - 1;
+            height_cutoff = 1 - config.elevations.back().perc;
+            wall_height = mountain_biome->wall_height;
+            num_cells = {config.num_cells, config.num_cells};
+            cell_size = map_size / num_cells;
+            max_samples = cell_size.w * cell_size.h * config.sample_factor;
+
+            // the map only depends on the salt, anchors and vegetation are placed by position
+            salt = random_fast() * 2147483648u;
+            const int climate_cluster_factor = 4;
+            for (short y = 0; y < num_cells.h; y++) {
+                for (short x = 0; x < num_cells.w; x++) {
+                    const int cluster_x = x - (x % climate_cluster_factor);
+                    const int cluster_y = y - (y % climate_cluster_factor);
+                    anchors.emplace_back(
+                        Point((x + random_hash(salt + 1, x, y)) * cell_size.w, (y + random_hash(salt + 2, x, y)) * cell_size.h),
+                        random_hash(salt + 3, x, y),
+                        20 + 60 * random_hash(salt + 4, cluster_x, cluster_y)
+                    );
+                }
+            }
+
             std::vector<Texture::ID> prev_ids;
             for (Config::Elevation& elevation : config.elevations) {
                 std::vector<Texture::ID> prev_ids_temp;
@@ -108,197 +161,471 @@ class MapGen {
                 }
                 prev_ids = prev_ids_temp;
             }
-            std::vector<std::string> params(5);
-            for (short y_map = 0; y_map < map_size.h; y_map++) {
-                for (short x_map = 0; x_map < map_size.w; x_map++) {
-                    Texture::ID current_id = map->get_ground({x_map, y_map});
-                    if (blend_map.find(current_id) != blend_map.end()) {
-                        auto& blend_set = blend_map[current_id];
-                        bool blend = false;
-                        if (y_map > 0 && blend_set.find(map->get_ground({x_map+0, y_map-1})) != blend_set.end()) {
-                            params[1] = name_map[map->get_ground({x_map+0, y_map-1})]; blend = true;
-                        } else { params[1] = ""; }
-                        if (x_map < map_size.w-1 && blend_set.find(map->get_ground({x_map+1, y_map+0})) != blend_set.end()) {
-                            params[2] = name_map[map->get_ground({x_map+1, y_map-0})]; blend = true;
-                        } else { params[2] = ""; }
-                        if (y_map < map_size.h-1 && blend_set.find(map->get_ground({x_map+0, y_map+1})) != blend_set.end()) {
-                            params[3] = name_map[map->get_ground({x_map+0, y_map+1})]; blend = true;
-                        } else { params[3] = ""; }
-                        if (x_map > 0 && blend_set.find(map->get_ground({x_map-1, y_map+0})) != blend_set.end()) {
-                            params[4] = name_map[map->get_ground({x_map-1, y_map+0})]; blend = true;
-                        } else { params[4] = ""; }
-                        if (blend) {
-                            params[0] = name_map[current_id];
-                            std::string n = Engine.textures()->generate_name("blend", params);
-                            map->set_ground(n, {x_map, y_map}, false);
-                        }
-                     }
-                }
-            }
         }
 
-        struct Anchor {
-            static constexpr int PERC_FACTOR = 100000;
-            Anchor(Point p, double pc, char t): pos(p), perc(PERC_FACTOR * pc), temp(t) {}
-            Point pos;
-            long long perc;
-            char temp;
-        };
+        int chunks_x() const { return (map_size.w + CHUNK_TILES - 1) / CHUNK_TILES; }
+        int chunks_y() const { return (map_size.h + CHUNK_TILES - 1) / CHUNK_TILES; }
 
-        static void randomize_map() {
-            auto map = Engine.map();
-            Size map_size = map->tilemap_size();
-            Size tile_dim = map->tile_size();
-
-            Config config;
-            Size num_cells = {config.num_cells, config.num_cells};
-            Size cell_size = map_size / num_cells;
-            int max_samples = cell_size.w * cell_size.h * config.sample_factor; // 3
-            int sample_dist = config.sample_distance; // 2
-            
-            Matrix<unsigned char>* heightmap = new Matrix<unsigned char>("heightmap", map_size.w, map_size.h);
-            Config::Biome& mountain_biome = config.elevations.back().biomes[0];
-            unsigned char max_height = mountain_biome.max_height - 1;
-            double height_cutoff = 1 - config.elevations.back().perc;
-            short wall_height = mountain_biome.wall_height;
+        // ground of the tiles that were not generated yet
+        Config::Elevation& placeholder() { return config.elevations[0]; }
 
-            const int climate_cluster_factor = 4;
-            double r;
-            std::vector<Anchor> anchors;
-            for (short y = 0; y < num_cells.h; y++) {
-                for (short x = 0; x < num_cells.w; x++) {
-                    if (x % climate_cluster_factor == 0 && y % climate_cluster_factor == 0) {
-                        r = random_uniform(20, 80);
-                    } else {
-                        short use_x = x - (x % climate_cluster_factor);
-                        short use_y = (y - (y % climate_cluster_factor)) * num_cells.w; 
-                        r = anchors[use_y + use_x].temp;
+        // thread safe, the result only depends on the salt and the chunk position
+        void generate(Chunk& chunk, int cx, int cy) const {
+            chunk.pos = Point(cx * CHUNK_TILES, cy * CHUNK_TILES);
+            chunk.size = Size(std::min(CHUNK_TILES, map_size.w - chunk.pos.x), std::min(CHUNK_TILES, map_size.h - chunk.pos.y));
+            const int x0 = chunk.pos.x;
+            const int y0 = chunk.pos.y;
+            const int x1 = x0 + chunk.size.w;
+            const int y1 = y0 + chunk.size.h;
+
+            // samples around the chunk, walls reach down from wall_height tiles above and the
+            // vegetation depends on the items that can overlap it
+            const int margin = std::max(2, item_reach - 1);
+            const int gx0 = x0 - margin;
+            const int gy0 = y0 - wall_height - margin;
+            const int gw = chunk.size.w + margin + std::max(2, 2 * item_reach - 2);
+            const int gh = chunk.size.h + wall_height + 2 * margin;
+            std::vector<Sample> samples(gw * gh);
+            std::vector<Anchor> current_anchors;
+            int current_cell = -1;
+            for (int gy = 0; gy < gh; gy++) {
+                for (int gx = 0; gx < gw; gx++) {
+                    const int x = wrap(gx0 + gx, map_size.w);
+                    const int y = wrap(gy0 + gy, map_size.h);
+                    const int x_cell = std::min(x / cell_size.w, num_cells.w - 1);
+                    const int y_cell = std::min(y / cell_size.h, num_cells.h - 1);
+                    if (y_cell * num_cells.w + x_cell != current_cell) {
+                        current_cell = y_cell * num_cells.w + x_cell;
+                        gather_anchors(x_cell, y_cell, current_anchors);
                     }
-                    anchors.emplace_back(
-                        Point((x + random_fast()) * cell_size.w, (y + random_fast()) * cell_size.h), 
-                        random_fast(),
-                        r
-                    ); 
+                    samples[gy * gw + gx] = sample(x, y, current_anchors);
                 }
             }
-            /*
-            for (short y_map = 0; y_map < map_size.h; y_map++) {
-                for (short x_map = 0; x_map < map_size.w; x_map++) {
-                    tiles_ground->get(x_map, y_map) = 0;
-                    tiles_above->get(x_map, y_map) = 0;
-                    heightmap->get(x_map, y_map) = 0;
+            auto at = [&](int x, int y) -> const Sample& { return samples[(y - gy0) * gw + x - gx0]; };
+            auto height = [&](int x, int y) { return at(x, y).height; };
+            // the tiles that can get walls below and borders
+            auto edge = [&](int x, int y) { return x >= 1 && x < map_size.w - 1 && y >= 1 && y < map_size.h - wall_height; };
+            auto wall = [&](int x, int y) {
+                for (int h = 1; h <= wall_height; h++) {
+                    if (edge(x, y - h) && height(x, y - h) > height(x, y - h + 1)) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+
+            // ground before blending, one tile around the chunk as neighbors, named textures are 0
+            const int fw = chunk.size.w + 2;
+            const int fh = chunk.size.h + 2;
+            std::vector<Texture::ID> ground(fw * fh);
+            std::vector<std::string> border_names(fw * fh);
+            for (int y = y0 - 1; y <= y1; y++) {
+                for (int x = x0 - 1; x <= x1; x++) {
+                    const int i = (y - y0 + 1) * fw + x - x0 + 1;
+                    ground[i] = at(x, y).ground;
+                    if (ground[i] < 0) {
+                        continue;
+                    }
+                    if (wall(x, y)) {
+                        ground[i] = -wall_id;
+                        continue;
+                    }
+                    if (!edge(x, y)) {
+                        continue;
+                    }
+                    std::string postfix = "";
+                    if (height(x, y) && height(x, y) > height(x, y - 1)) {
+                        postfix += "top";
+                    }
+                    if (height(x, y) > height(x, y + 1)) {
+                        postfix += "bottom";
+                    }
+                    if (height(x, y) > height(x - 1, y)) {
+                        postfix += "left";
+                    }
+                    if (height(x, y) > height(x + 1, y)) {
+                        postfix += "right";
+                    }
+                    if (!postfix.empty()) {
+                        border_names[i] = Engine.textures()->generate_name("border_alpha", {mountain_biome->name, postfix});
+                        ground[i] = 0;
+                    }
                 }
             }
-            */
-            parallel_for(0, num_cells.h-1, [&](int y_cell) {
-                for (short x_cell = 0; x_cell < num_cells.w; x_cell++) {
-                    Box sample_cells(Point(x_cell - sample_dist, y_cell - sample_dist), Point(x_cell + sample_dist, y_cell + sample_dist));
-                    std::vector<Anchor> current_anchors;
-                    for (short y_cells = sample_cells.a.y; y_cells <= sample_cells.b.y; y_cells++) {
-                        for (short x_cells = sample_cells.a.x; x_cells <= sample_cells.b.x; x_cells++) {
-                            short x_cur = x_cells;
-                            short x_offset = 0;
-                            if (x_cur < 0) {
-                                x_offset = -map_size.w;
-                                x_cur += num_cells.w;
-                            } else if (x_cur > num_cells.w - 1) {
-                                x_offset = map_size.w;
-                                x_cur -= num_cells.w;
-                            }
-                            short y_cur = y_cells;
-                            short y_offset = 0;
-                            if (y_cur < 0) {
-                                y_offset = -map_size.h;
-                                y_cur += num_cells.h;
-                            } else if (y_cur > num_cells.h - 1) {
-                                y_offset = map_size.h;
-                                y_cur -= num_cells.h;
+
+            // blend into the neighbors of lower or earlier biomes
+            chunk.ground.assign(chunk.size.w * chunk.size.h, 0);
+            chunk.names.assign(chunk.size.w * chunk.size.h, -1);
+            chunk.texture_names.clear();
+            chunk.items.clear();
+            std::map<std::string, short> name_index;
+            auto add_name = [&](const std::string& name) {
+                auto it = name_index.find(name);
+                if (it == name_index.end()) {
+                    it = name_index.emplace(name, chunk.texture_names.size()).first;
+                    chunk.texture_names.push_back(name);
+                }
+                return it->second;
+            };
+            auto ground_id = [&](int x, int y) -> Texture::ID {
+                Texture::ID id = ground[(y - y0 + 1) * fw + x - x0 + 1];
+                return id < 0 ? -id : id;
+            };
+            std::vector<std::string> params(5);
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    const int i = (y - y0 + 1) * fw + x - x0 + 1;
+                    const int j = (y - y0) * chunk.size.w + x - x0;
+                    chunk.ground[j] = ground[i];
+                    if (!border_names[i].empty()) {
+                        chunk.names[j] = add_name(border_names[i]);
+                        continue;
+                    }
+                    auto blend_set = blend_map.find(ground_id(x, y));
+                    if (blend_set == blend_map.end()) {
+                        continue;
+                    }
+                    auto neighbor = [&](int nx, int ny, bool inside) -> std::string {
+                        if (!inside || blend_set->second.find(ground_id(nx, ny)) == blend_set->second.end()) {
+                            return "";
+                        }
+                        return name_map.at(ground_id(nx, ny));
+                    };
+                    params[1] = neighbor(x, y - 1, y > 0);
+                    params[2] = neighbor(x + 1, y, x < map_size.w - 1);
+                    params[3] = neighbor(x, y + 1, y < map_size.h - 1);
+                    params[4] = neighbor(x - 1, y, x > 0);
+                    if (!params[1].empty() || !params[2].empty() || !params[3].empty() || !params[4].empty()) {
+                        params[0] = name_map.at(ground_id(x, y));
+                        chunk.names[j] = add_name(Engine.textures()->generate_name("blend", params));
+                        chunk.ground[j] = 0;
+                    }
+                }
+            }
+
+            // vegetation: the hash picks an item for a root tile if its area is free ground, and it is
+            // kept unless an item picked at an earlier tile overlaps it. That only depends on the
+            // tiles around, so items can reach into the next chunks and come out the same in any order
+            auto pick = [&](int x, int y) -> const Config::Item* {
+                if (x < 0 || y < 0) {
+                    return nullptr;
+                }
+                double val = random_hash(salt, x, y);
+                double current_val = 0;
+                for (auto& item : at(x, y).biome->items) {
+                    current_val += item.perc;
+                    if (val - current_val > 0.01) {
+                        continue;
+                    }
+                    Size s = item.size() / tile_dim;
+                    if (x + s.w >= map_size.w || y + s.h >= map_size.h) {
+                        return nullptr;
+                    }
+                    for (int y2 = y; y2 < y + s.h; y2++) {
+                        for (int x2 = x; x2 < x + s.w; x2++) {
+                            if (at(x2, y2).ground < 0 || wall(x2, y2)) {
+                                return nullptr;
                             }
-                            current_anchors.emplace_back(anchors[y_cur * num_cells.w + x_cur]);
-                            current_anchors.back().pos.x += x_offset;
-                            current_anchors.back().pos.y += y_offset;
                         }
                     }
-                    for (short y_map = y_cell * cell_size.h; y_map < (short)((y_cell + 1) * cell_size.h); y_map++) {
-                        for (short x_map = x_cell * cell_size.w; x_map < (short)((x_cell + 1) * cell_size.w); x_map++) {
-                            unsigned long long sum_val = 0;
-                            unsigned long long sum_temp = 0;
-                            unsigned long long total_samples = 0;
-                            for (int i = 0; i < (int)current_anchors.size(); i++) {
-                                int diffx = current_anchors[i].pos.x - x_map;
-                                int diffy = current_anchors[i].pos.y - y_map;
-                                int dist = ((diffx ^ (diffx >> 31)) - (diffx >> 31)) + ((diffy ^ (diffy >> 31)) - (diffy >> 31));
-                                int num_samples = max_samples - dist * dist;
-                                num_samples = 1 + (num_samples & -((num_samples >> 31) ^ 1));
-                                sum_val += num_samples * current_anchors[i].perc;
-                                sum_temp += num_samples * current_anchors[i].temp;
-                                total_samples += num_samples;
+                    return &item;
+                }
+                return nullptr;
+            };
+            // roots of the chunk and of the earlier items that can overlap them
+            const int px0 = x0 - item_reach + 1;
+            const int py0 = y0 - item_reach + 1;
+            const int pw = chunk.size.w + 2 * item_reach - 2;
+            const int ph = chunk.size.h + item_reach - 1;
+            std::vector<const Config::Item*> picks(pw * ph);
+            for (int y = py0; y < py0 + ph; y++) {
+                for (int x = px0; x < px0 + pw; x++) {
+                    picks[(y - py0) * pw + x - px0] = pick(x, y);
+                }
+            }
+            chunk.end = Point(x1, y1);
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    const Config::Item* item = picks[(y - py0) * pw + x - px0];
+                    if (!item) {
+                        continue;
+                    }
+                    Size s = item->size() / tile_dim;
+                    bool overlapped = false;
+                    for (int ey = y - item_reach + 1; ey <= y && !overlapped; ey++) {
+                        for (int ex = x - item_reach + 1; ex < x + item_reach && !overlapped; ex++) {
+                            if (ey == y && ex >= x) {
+                                break;
                             }
-                            double total_val = (double)sum_val / (total_samples * Anchor::PERC_FACTOR);
-                            double total_temp = (double)sum_temp / total_samples;
-
-                            double current_val = 0;
-                            for (Config::Elevation& elevation : config.elevations) {
-                                current_val += elevation.perc;
-                                if (total_val - current_val <= 0.001) {
-                                    int biome_index = 0;
-                                    if (elevation.biomes.size() > 1) {
-                                        for (biome_index = 0; biome_index < (int)elevation.biomes.size()-1; biome_index++) {
-                                            if (total_temp < elevation.temperatures[biome_index]) {
-                                                break;
-                                            }
-                                        }
-                                    }
-                                    Config::Biome& biome = elevation.biomes[biome_index];
-                                    if (biome.max_height > 0) {
-                                        char height = max_height * (total_val - height_cutoff) / (1 - height_cutoff);
-                                        heightmap->get(x_map, y_map) = height < 0 ? 0 : height;
-                                    }
-                                    map->set_ground(biome.id(), {x_map, y_map}, elevation.blocking);
-                                    double val = random_fast();
-                                    current_val = 0;
-                                    for (auto& item : biome.items) {
-                                        current_val += item.perc;
-                                        if (val - current_val <= 0.01) {
-                                            map->set_tile(item.id(), {x_map, y_map}, item.size() / tile_dim);
-                                            break;
-                                        }
-                                    }
-                                    break;
-                                }
+                            const Config::Item* earlier = picks[(ey - py0) * pw + ex - px0];
+                            if (earlier) {
+                                Size es = earlier->size() / tile_dim;
+                                overlapped = ex < x + s.w && x < ex + es.w && ey < y + s.h && y < ey + es.h;
                             }
                         }
                     }
+                    if (!overlapped) {
+                        chunk.items.emplace_back(Point(x, y), item);
+                        chunk.end = Point(std::max<int>(chunk.end.x, x + s.w), std::max<int>(chunk.end.y, y + s.h));
+                    }
                 }
-            });
+            }
+        }
 
-            for (short y_map = 1; y_map < map_size.h - wall_height; y_map++) {
-                for (short x_map = 1; x_map < map_size.w - 1; x_map++) {
-                    std::string postfix = "";
-                    if (heightmap->get(x_map, y_map) && heightmap->get(x_map, y_map) > heightmap->get(x_map, y_map-1)) {
-                        postfix += "top";
+        // on the main thread, textures of new blends and borders are created here
+        void apply(const Chunk& chunk) {
+            auto map = Engine.map();
+            std::vector<Texture::ID> named;
+            for (auto& name : chunk.texture_names) {
+                named.push_back(Engine.textures()->get(name)->id());
+            }
+            for (short y = 0; y < chunk.size.h; y++) {
+                for (short x = 0; x < chunk.size.w; x++) {
+                    const int i = y * chunk.size.w + x;
+                    const Texture::ID id = chunk.names[i] >= 0 ? named[chunk.names[i]] : chunk.ground[i];
+                    map->set_ground(id < 0 ? -id : id, Point(chunk.pos.x + x, chunk.pos.y + y), id < 0);
+                }
+            }
+            // the ground below items that reach into other chunks may not be applied yet
+            for (auto& item : chunk.items) {
+                map->set_tile(item.second->m_id, item.first, item.second->size() / tile_dim, false);
+            }
+        }
+
+        // the whole map at once, chunks are generated in parallel and applied in batches
+        void generate_map() {
+            const int num_chunks = chunks_x() * chunks_y();
+            const int batch = std::max(chunks_x(), 4 * num_workers());
+            std::vector<Chunk> chunks(batch);
+            for (int first = 0; first < num_chunks; first += batch) {
+                const int n = std::min(batch, num_chunks - first);
+                parallel_for(0, n - 1, [&](int i) {
+                    generate(chunks[i], (first + i) % chunks_x(), (first + i) / chunks_x());
+                }, 1);
+                for (int i = 0; i < n; i++) {
+                    apply(chunks[i]);
+                }
+            }
+        }
+
+    private:
+        struct Sample {
+            const Config::Biome* biome = nullptr;
+            Texture::ID ground = 0; // negative if blocked
+            unsigned char height = 0;
+        };
+
+        Config config;
+        Size map_size;
+        Size tile_dim;
+        Size num_cells;
+        Size cell_size;
+        int max_samples = 0;
+        unsigned salt = 0;
+        std::vector<Anchor> anchors;
+        Config::Biome* mountain_biome = nullptr;
+        Texture::ID wall_id = 0;
+        unsigned char max_height = 0;
+        double height_cutoff = 0;
+        short wall_height = 0;
+        int item_reach = 1; // tiles covered by the largest item in either direction
+        std::map<Texture::ID, std::map<Texture::ID, int>> blend_map;
+        std::map<Texture::ID, std::string> name_map;
+
+        static int wrap(int v, int n) { return ((v % n) + n) % n; }
+
+        // the anchors within sample distance of a cell, moved across the map edges
+        void gather_anchors(int x_cell, int y_cell, std::vector<Anchor>& current_anchors) const {
+            const int sample_dist = config.sample_distance;
+            current_anchors.clear();
+            for (int y_cells = y_cell - sample_dist; y_cells <= y_cell + sample_dist; y_cells++) {
+                for (int x_cells = x_cell - sample_dist; x_cells <= x_cell + sample_dist; x_cells++) {
+                    short x_cur = x_cells;
+                    short x_offset = 0;
+                    if (x_cur < 0) {
+                        x_offset = -map_size.w;
+                        x_cur += num_cells.w;
+                    } else if (x_cur > num_cells.w - 1) {
+                        x_offset = map_size.w;
+                        x_cur -= num_cells.w;
                     }
-                    if (heightmap->get(x_map, y_map) > heightmap->get(x_map, y_map+1)) {
-                        postfix += "bottom";
-                        for (int i = 1; i <= wall_height; i++) { 
-                            map->set_ground(mountain_biome.name_wall, {x_map+0, y_map+i}, true);
-                        }
+                    short y_cur = y_cells;
+                    short y_offset = 0;
+                    if (y_cur < 0) {
+                        y_offset = -map_size.h;
+                        y_cur += num_cells.h;
+                    } else if (y_cur > num_cells.h - 1) {
+                        y_offset = map_size.h;
+                        y_cur -= num_cells.h;
                     }
-                    if (heightmap->get(x_map, y_map) > heightmap->get(x_map-1, y_map)) {
-                        postfix += "left";
+                    current_anchors.emplace_back(anchors[y_cur * num_cells.w + x_cur]);
+                    current_anchors.back().pos.x += x_offset;
+                    current_anchors.back().pos.y += y_offset;
+                }
+            }
+        }
+
+        Sample sample(int x_map, int y_map, const std::vector<Anchor>& current_anchors) const {
+            unsigned long long sum_val = 0;
+            unsigned long long sum_temp = 0;
+            unsigned long long total_samples = 0;
+            for (int i = 0; i < (int)current_anchors.size(); i++) {
+                int diffx = current_anchors[i].pos.x - x_map;
+                int diffy = current_anchors[i].pos.y - y_map;
+                int dist = ((diffx ^ (diffx >> 31)) - (diffx >> 31)) + ((diffy ^ (diffy >> 31)) - (diffy >> 31));
+                int num_samples = max_samples - dist * dist;
+                num_samples = 1 + (num_samples & -((num_samples >> 31) ^ 1));
+                sum_val += num_samples * current_anchors[i].perc;
+                sum_temp += num_samples * current_anchors[i].temp;
+                total_samples += num_samples;
+            }
+            double total_val = (double)sum_val / (total_samples * Anchor::PERC_FACTOR);
+            double total_temp = (double)sum_temp / total_samples;
+
+            Sample s;
+            double current_val = 0;
+            for (const Config::Elevation& elevation : config.elevations) {
+                current_val += elevation.perc;
+                if (total_val - current_val <= 0.001 || &elevation == &config.elevations.back()) {
+                    int biome_index = 0;
+                    if (elevation.biomes.size() > 1) {
+                        for (biome_index = 0; biome_index < (int)elevation.biomes.size()-1; biome_index++) {
+                            if (total_temp < elevation.temperatures[biome_index]) {
+                                break;
+                            }
+                        }
                     }
-                    if (heightmap->get(x_map, y_map) > heightmap->get(x_map+1, y_map)) {
-                        postfix += "right";
+                    s.biome = &elevation.biomes[biome_index];
+                    if (s.biome->max_height > 0) {
+                        char height = max_height * (total_val - height_cutoff) / (1 - height_cutoff);
+                        s.height = height < 0 ? 0 : height;
                     }
-                    if (!postfix.empty()) {
-                        std::string n = Engine.textures()->generate_name("border_alpha", {mountain_biome.name, postfix});
-                        map->set_ground(n, {x_map, y_map}, false);
+                    s.ground = elevation.blocking ? -s.biome->m_id : s.biome->m_id;
+                    break;
+                }
+            }
+            return s;
+        }
+};
+
+// Generates the map chunk by chunk in background jobs, the chunks in and ahead of the view first
+class MapStream {
+    public:
+        MapStream(Size map_size, Size tile_dim): gen(map_size, tile_dim), state(gen.chunks_x() * gen.chunks_y(), NONE), remaining(state.size()) {}
+
+        ~MapStream() {
+            for (auto& job : jobs) {
+                wait_job(job.job);
+                delete job.chunk;
+            }
+        }
+
+        MapGen& map_gen() { return gen; }
+        bool finished() { return remaining == 0; }
+
+        // applies the finished chunks and returns their areas, then queues the chunks in the view,
+        // those the camera moves to and finally the rest of the map
+        std::vector<Box> update(Box view, Point ahead) {
+            std::vector<Box> applied;
+            for (int i = 0; i < (int)jobs.size(); ) {
+                if (job_done(jobs[i].job)) {
+                    applied.push_back(finish_job(i));
+                } else {
+                    i++;
+                }
+            }
+            const int max_jobs = 2 * num_workers();
+            if ((int)jobs.size() >= max_jobs) {
+                return applied;
+            }
+            const int x1 = chunk_of(std::min(view.a.x, (short)(view.a.x + ahead.x))) - 1;
+            const int y1 = chunk_of(std::min(view.a.y, (short)(view.a.y + ahead.y))) - 1;
+            const int x2 = std::min(chunk_of(std::max(view.b.x, (short)(view.b.x + ahead.x))) + 1, x1 + gen.chunks_x() - 1);
+            const int y2 = std::min(chunk_of(std::max(view.b.y, (short)(view.b.y + ahead.y))) + 1, y1 + gen.chunks_y() - 1);
+            const int center_x = chunk_of((view.a.x + view.b.x) / 2);
+            const int center_y = chunk_of((view.a.y + view.b.y) / 2);
+            std::vector<std::pair<int, int>> candidates; // distance to the view center and chunk
+            for (int cy = y1; cy <= y2; cy++) {
+                for (int cx = x1; cx <= x2; cx++) {
+                    const int index = wrap(cy, gen.chunks_y()) * gen.chunks_x() + wrap(cx, gen.chunks_x());
+                    if (state[index] == NONE) {
+                        candidates.emplace_back((cx - center_x) * (cx - center_x) + (cy - center_y) * (cy - center_y), index);
                     }
                 }
             }
+            std::sort(candidates.begin(), candidates.end());
+            for (int i = 0; i < (int)candidates.size() && (int)jobs.size() < max_jobs; i++) {
+                queue(candidates[i].second);
+            }
+            for (; next_chunk < (int)state.size() && (int)jobs.size() < max_jobs; next_chunk++) {
+                if (state[next_chunk] == NONE) {
+                    queue(next_chunk);
+                }
+            }
+            return applied;
+        }
+
+        // applies the chunk of the tile right away, returns its area or an empty box if it was done
+        Box require(Point tile) {
+            const int index = chunk_of(tile.y) * gen.chunks_x() + chunk_of(tile.x);
+            if (state[index] == NONE) {
+                queue(index);
+            }
+            for (int i = 0; i < (int)jobs.size(); i++) {
+                if (jobs[i].index == index) {
+                    wait_job(jobs[i].job);
+                    return finish_job(i);
+                }
+            }
+            return Box();
+        }
+
+        // generates and applies all remaining chunks
+        void finish() {
+            for (int i = 0; i < (int)state.size(); i++) {
+                if (state[i] == NONE) {
+                    queue(i);
+                }
+            }
+            while (!jobs.empty()) {
+                wait_job(jobs.front().job);
+                finish_job(0);
+            }
+        }
+
+    private:
+        enum State : unsigned char {NONE, QUEUED, DONE};
+        struct Job {
+            int index;
+            MapGen::Chunk* chunk;
+            JobHandle job;
+        };
+        MapGen gen;
+        std::vector<State> state;
+        int remaining;
+        std::vector<Job> jobs;
+        int next_chunk = 0;
+
+        static int chunk_of(int tile) { return (tile < 0 ? tile - MapGen::CHUNK_TILES + 1 : tile) / MapGen::CHUNK_TILES; }
+        static int wrap(int v, int n) { return ((v % n) + n) % n; }
+
+        void queue(int index) {
+            MapGen::Chunk* chunk = new MapGen::Chunk();
+            const int cx = index % gen.chunks_x();
+            const int cy = index / gen.chunks_x();
+            jobs.push_back({index, chunk, run_background_job([this, chunk, cx, cy]() { gen.generate(*chunk, cx, cy); })});
+            state[index] = QUEUED;
+        }
 
-            post_process(config, map_size);
-            delete heightmap;
+        Box finish_job(int i) {
+            Job job = jobs[i];
+            jobs.erase(jobs.begin() + i);
+            gen.apply(*job.chunk);
+            state[job.index] = DONE;
+            remaining--;
+            Box area(job.chunk->pos, job.chunk->end);
+            delete job.chunk;
+            return area;
         }
 };
 
@@ -0,0 +1,192 @@
+#include "profiler.h"
+#include "screen.h"
+#include <cstdio>
+
+void Profiler::begin_frame() {
+    Frame& f = current();
+    f.number = frame_count;
+    f.start = now();
+    f.duration = 0;
+    f.num_phases = 0;
+    depth = 0;
+    in_frame = true;
+}
+
+void Profiler::end_frame() {
+    if (!in_frame) {
+        return;
+    }
+    Frame& f = current();
+    f.duration = now() - f.start;
+    in_frame = false;
+    frame_count++;
+}
+
+void Profiler::begin(const char* name) {
+    Frame& f = current();
+    if (!in_frame || f.num_phases >= MAX_PHASES || depth >= MAX_PHASES) {
+        if (depth < MAX_PHASES) {
+            open_phases[depth] = -1; // so the matching end() leaves earlier siblings alone
+        }
+        depth++;
+        return;
+    }
+    open_phases[depth] = f.num_phases;
+    f.phases[f.num_phases++] = {name, now(), 0, depth};
+    depth++;
+}
+
+void Profiler::end() {
+    depth--;
+    Frame& f = current();
+    if (!in_frame || depth < 0 || depth >= MAX_PHASES) {
+        depth = std::max(depth, 0);
+        return;
+    }
+    int idx = open_phases[depth];
+    if (idx >= 0 && idx < f.num_phases && f.phases[idx].depth == depth) {
+        f.phases[idx].duration = now() - f.phases[idx].start;
+    }
+}
+
+static Profiler::Stats percentiles(std::vector<int>& v) {
+    Profiler::Stats s;
+    if (v.empty()) {
+        return s;
+    }
+    auto at = [&](double p) {
+        auto it = v.begin() + std::min<int>(v.size() - 1, p * v.size());
+        std::nth_element(v.begin(), it, v.end());
+        return (double)*it;
+    };
+    s.p50 = at(0.5);
+    s.p95 = at(0.95);
+    s.p99 = at(0.99);
+    return s;
+}
+
+Profiler::Stats Profiler::stats(const std::string& phase) {
+    std::vector<int> durations;
+    for (int i = 1; i <= num_frames(); i++) {
+        Frame& f = frames[(frame_count - i) % MAX_FRAMES];
+        if (phase.empty()) {
+            durations.push_back(f.duration);
+            continue;
+        }
+        // nested phases of the same name are counted once per frame
+        int sum = 0;
+        bool found = false;
+        for (int j = 0; j < f.num_phases; j++) {
+            if (phase == f.phases[j].name) {
+                sum += f.phases[j].duration;
+                found = true;
+            }
+        }
+        if (found) {
+            durations.push_back(sum);
+        }
+    }
+    return percentiles(durations);
+}
+
+std::vector<std::string> Profiler::phase_names() {
+    std::vector<std::string> names;
+    for (int i = 1; i <= num_frames(); i++) {
+        Frame& f = frames[(frame_count - i) % MAX_FRAMES];
+        for (int j = 0; j < f.num_phases; j++) {
+            if (std::find(names.begin(), names.end(), f.phases[j].name) == names.end()) {
+                names.push_back(f.phases[j].name);
+            }
+        }
+    }
+    return names;
+}
+
+bool Profiler::write_csv(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "frame,phase,depth,start_us,duration_us\n");
+    for (int i = num_frames(); i > 0; i--) {
+        Frame& f = frames[(frame_count - i) % MAX_FRAMES];
+        fprintf(file, "%lld,frame,-1,0,%d\n", f.number, f.duration);
+        for (int j = 0; j < f.num_phases; j++) {
+            Phase& p = f.phases[j];
+            fprintf(file, "%lld,%s,%d,%lld,%d\n", f.number, p.name, p.depth, p.start - f.start, p.duration);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+// Chrome trace event format, viewable in chrome://tracing or Perfetto
+bool Profiler::write_trace(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "{\"traceEvents\":[");
+    bool first = true;
+    for (int i = num_frames(); i > 0; i--) {
+        Frame& f = frames[(frame_count - i) % MAX_FRAMES];
+        fprintf(file, "%s\n{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%lld,\"dur\":%d,\"args\":{\"frame\":%lld}}", first ? "" : ",", f.start, f.duration, f.number);
+        first = false;
+        for (int j = 0; j < f.num_phases; j++) {
+            Phase& p = f.phases[j];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%lld,\"dur\":%d}", p.name, p.start, p.duration);
+        }
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(file);
+    return true;
+}
+
+Box Profiler::draw_graph(unsigned* pixels, Size screen_size) {
+    const static unsigned palette[] = {0xFF4E79A7, 0xFFF28E2B, 0xFFE15759, 0xFF76B7B2, 0xFF59A14F, 0xFFEDC948, 0xFFB07AA1, 0xFFFF9DA7};
+    // a few slots of distance to the frames being recorded
+    const int w = std::min(MAX_FRAMES - 8, (int)screen_size.w);
+    const int h = std::min(GRAPH_HEIGHT, (int)screen_size.h);
+    const Box graph_box(Point(screen_size.w - w, 0), Size(w, h));
+    const long long count = frame_count;
+    for (int y = 0; y < h; y++) {
+        std::fill(pixels + y * screen_size.w + graph_box.a.x, pixels + y * screen_size.w + graph_box.b.x, 0xFF202020);
+    }
+
+    // one column per frame, newest on the right, stacked by top level phase
+    std::vector<std::string> names;
+    for (int i = 1; i <= std::min<long long>(w, std::min<long long>(count, MAX_FRAMES - 1)); i++) {
+        Frame& f = frames[(count - i) % MAX_FRAMES];
+        const int x = graph_box.b.x - i;
+        int y = h;
+        for (int j = 0; j < f.num_phases; j++) {
+            Phase& p = f.phases[j];
+            if (p.depth != 0) {
+                continue;
+            }
+            auto it = std::find(names.begin(), names.end(), p.name);
+            const int color_idx = it - names.begin();
+            if (it == names.end()) {
+                names.push_back(p.name);
+            }
+            const int y_end = std::max(0, y - p.duration / GRAPH_US_PER_PIXEL);
+            for (; y > y_end; y--) {
+                pixels[(y - 1) * screen_size.w + x] = palette[color_idx % 8];
+            }
+        }
+        // time outside of any phase
+        const int y_end = std::max(0, h - f.duration / GRAPH_US_PER_PIXEL);
+        for (; y > y_end; y--) {
+            pixels[(y - 1) * screen_size.w + x] = 0xFFA0A0A0;
+        }
+    }
+
+    // 60 and 30 fps marks
+    for (int us : {16667, 33333}) {
+        const int y = h - us / GRAPH_US_PER_PIXEL;
+        if (y >= 0) {
+            std::fill(pixels + y * screen_size.w + graph_box.a.x, pixels + y * screen_size.w + graph_box.b.x, 0xFFFFFFFF);
+        }
+    }
+    return graph_box;
+}
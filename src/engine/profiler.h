@@ -0,0 +1,68 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "engine.h"
+#include <atomic>
+
+// Timings of the phases of the last frames, phases can be nested
+class Profiler {
+    public:
+        struct Stats {
+            double p50 = 0;
+            double p95 = 0;
+            double p99 = 0;
+        };
+
+        // times a phase until the end of the scope, ignored outside of a frame
+        class Scope {
+            public:
+                Scope(const char* name) { Engine.profiler()->begin(name); }
+                ~Scope() { Engine.profiler()->end(); }
+        };
+
+        void begin_frame();
+        void end_frame();
+        void begin(const char* name);
+        void end();
+
+        // percentiles in microseconds, of whole frames or all phases with the given name
+        Stats stats(const std::string& phase = "");
+        std::vector<std::string> phase_names();
+        bool write_csv(const std::string& path);
+        bool write_trace(const std::string& path);
+
+        void show_graph(bool show) { graph_visible = show; }
+        bool showing_graph() { return graph_visible; }
+        // draws the frame times of the finished frames into the top right corner and returns the covered area,
+        // can run on the present thread while the next frame is recorded
+        Box draw_graph(unsigned* pixels, Size screen_size);
+
+    private:
+        constexpr static int MAX_FRAMES = 256;
+        constexpr static int MAX_PHASES = 64;
+        constexpr static int GRAPH_HEIGHT = 128;
+        constexpr static int GRAPH_US_PER_PIXEL = 500;
+        struct Phase {
+            const char* name;
+            long long start;
+            int duration;
+            int depth;
+        };
+        struct Frame {
+            long long number = 0;
+            long long start = 0;
+            int duration = 0;
+            int num_phases = 0;
+            Phase phases[MAX_PHASES];
+        };
+        Frame frames[MAX_FRAMES];
+        std::atomic<long long> frame_count{0};
+        bool in_frame = false;
+        int open_phases[MAX_PHASES];
+        int depth = 0;
+        bool graph_visible = false;
+        Frame& current() { return frames[frame_count % MAX_FRAMES]; }
+        int num_frames() { return (int)std::min<long long>(frame_count, MAX_FRAMES - 1); } // the oldest slot is being recorded
+};
+
+#endif
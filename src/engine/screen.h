@@ -3,6 +3,11 @@
 
 #include "engine.h"
 #include "texture.h"
+#include "profiler.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 class Composite {
     public:
@@ -12,120 +17,350 @@ class Composite {
          };
 
          Composite(Size sz): size(sz) {}
-         virtual ~Composite() { delete m_overlay; }
+         virtual ~Composite() { delete[] layer; }
 
          virtual std::vector<Composite*> get_children() { return children; }
          virtual void set_size(Size s) { size = s; }
-         virtual void add_child(Composite* child, Point offset) {
-             child->pos = pos + offset;
-             children.push_back(child);
-         }     
-         virtual void remove_child(Composite* child) {
-            children.erase(std::remove(children.begin(), children.end(), child), children.end()); 
-         }
+         virtual void add_child(Composite* child, Point offset);
+         // the area of the child is damaged, so whatever was below it gets repainted
+         virtual void remove_child(Composite* child);
          virtual void draw();
+         // draws the composite, or copies its cached layer if nothing inside the subtree changed
+         void render();
+         // keeps the subtree in an offscreen layer, it has to paint its whole area opaque and
+         // must not write to the screen pixels directly
+         void set_layered(bool l) { layered = l; delete[] layer; layer = nullptr; set_update(true); }
          virtual void init() {}
+         // shown in the frame profiler when drawn directly by the screen
+         virtual const char* profile_name() { return "Composite"; }
          Size get_size() { return size; } 
-         virtual void set_update(bool update) {
-             update_count = update ? MAX_NO_UPDATES : 0;
+         // true marks the composite dirty and damages its area, false marks it as drawn
+         virtual void set_update(bool update);
+         // marks the screen contents below this subtree as stale, e.g. after something was drawn over it
+         virtual void invalidate() {
              for (auto& child : children) {
-                 child->set_update(true);
+                 child->invalidate();
              }
          }
          void set_overlay(Color color, int num_frames = 1, Listener* listener = nullptr);
-         bool needs_update() {
-             if (update_count < MAX_NO_UPDATES) {
-                update_count++;
-                return false;
-             }
-             set_update(true);
-             update_count = 0;
-             return true;
-         }
+         // dirty or overlapping a damaged area of the screen
+         bool needs_update();
 
     protected:
-         int MAX_NO_UPDATES = 5;
+         // the parts to paint this frame, the whole composite if dirty
+         std::vector<Box> repaint_boxes();
+         bool dirty = true;
          std::vector<Color> overlay_colors;
          Listener* overlay_listener = nullptr;
-         Texture* m_overlay = nullptr;
+         Color overlay_color;
+         bool has_overlay = false;
          bool initialized = false;
          Point pos = {0, 0};
          Size size;
          Texture* m_texture = nullptr;
          std::vector<Composite*> children;
-         int update_count = 0;
+         Composite* parent = nullptr;
+         bool profile_children = false;
+         bool layered = false;
+         bool layer_dirty = true;
+         int* layer = nullptr;
 };
 
 class Screen : public Composite {
     public:
         Screen(Size sz): Composite(sz) {
-            bool fullscreen = (bool)Engine.config("settings")["resolution"]["fullscreen"].i();
-            pixels = (int*)create_window(sz, fullscreen);
+            auto& settings = Engine.config("settings");
+            bool fullscreen = (bool)settings["resolution"]["fullscreen"].i();
+            // ENGINE_HEADLESS=0|1 overrides the setting, e.g. on machines without a display
+            const char* env = getenv("ENGINE_HEADLESS");
+            headless = env ? atoi(env) != 0 : settings.contains("headless") && settings["headless"].i();
+            surface = (int*)create_window(sz, fullscreen, headless);
+            // headless frames are only read back, they are drawn straight into the framebuffer unless
+            // frames in flight are asked for, e.g. by engine_bench
+            in_flight = settings.contains("max_frames_in_flight") ? std::max(0, settings["max_frames_in_flight"].i()) : 0;
+            if (headless && in_flight == 0) {
+                buffers.push_back(surface);
+            } else {
+                for (int i = 0; i <= in_flight; i++) {
+                    buffers.push_back(new int[size.w * size.h]());
+                }
+            }
+            stale.resize(buffers.size());
+            buffer_busy.resize(buffers.size());
+            pixels = buffers[0];
+            if (in_flight > 0) {
+                present_thread = std::thread([this]() { present_loop(); });
+                // exit() tears down the statics, the thread must not copy into a closed window then
+                static bool stop_at_exit = false;
+                if (!stop_at_exit) {
+                    atexit([]() { Engine.screen()->stop_present(); });
+                    stop_at_exit = true;
+                }
+            }
+            profile_children = true;
+        }
+
+        ~Screen() {
+            stop_present();
+            for (int* buffer : buffers) {
+                if (buffer != surface) {
+                    delete[] buffer;
+                }
+            }
         }
 
         void init_script_api();
 
+        // redirects drawing into a buffer holding the given area of the screen, until pop_target(),
+        // everything drawn meanwhile is clipped to the area
+        void push_target(int* buffer, Box area) {
+            targets.push_back({pixels, stride, target_area});
+            stride = area.b.x - area.a.x;
+            pixels = buffer - (area.a.y * stride + area.a.x);
+            target_area = clip_to_target(area);
+        }
+        void pop_target() {
+            pixels = targets.back().pixels;
+            stride = targets.back().stride;
+            target_area = targets.back().area;
+            targets.pop_back();
+        }
+
         void clear() {
+            invalidate();
             children.clear();
             std::memset(pixels, 0, sizeof(int) * size.w * size.h); 
+            damage(Box(Point(0, 0), size));
+        }
+
+        void draw() {
+            drawing = true;
+            Composite::draw();
+            drawing = false;
+            // everything painted this frame lies in the damaged areas
+            for (auto& b : damage_rects) {
+                add_damage(frame_changes, b);
+            }
+            // damage reported while drawing may lie below composites that were already drawn
+            damage_rects.swap(pending_damage);
+            pending_damage.clear();
+            if (!damage_rects.empty()) {
+                Engine.request_frame();
+            }
+        }
+
+        // area whose contents changed and that has to be repainted, merged with overlapping areas
+        void damage(Box b) {
+            if (drawing) {
+                add_damage(pending_damage, b);
+            }
+            add_damage(damage_rects, b);
+        }
+
+        // area that was painted over while drawing, the composites on top of it are repainted
+        void painted(Box b) { add_damage(damage_rects, b); }
+
+        bool is_damaged(Box b) {
+            for (auto& r : damage_rects) {
+                if (r.a.x < b.b.x && b.a.x < r.b.x && r.a.y < b.b.y && b.a.y < r.b.y) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        std::vector<Box> damaged(Box b) {
+            std::vector<Box> ret;
+            for (auto& r : damage_rects) {
+                Box clip(Point(std::max(r.a.x, b.a.x), std::max(r.a.y, b.a.y)), Point(std::min(r.b.x, b.b.x), std::min(r.b.y, b.b.y)));
+                if (clip.a.x < clip.b.x && clip.a.y < clip.b.y) {
+                    ret.push_back(clip);
+                }
+            }
+            return ret;
         }
 
         inline void blit(Color* __restrict texture, Size texture_size, Point start, Box canvas, bool transparent, short texture_stride=0) {
             if (!texture_stride) texture_stride = texture_size.w;
+            canvas = clip_to_target(canvas);
             Point texture_end(start.x + texture_size.w, start.y + texture_size.h);
             Point texture_start(0, 0);
             Point texture_endcut(0, 0);
             if (start.x < canvas.a.x) {
                 texture_start.x = (canvas.a.x - start.x);
                 start.x = canvas.a.x;
-            } else if (texture_end.x > canvas.b.x) {
+            }
+            if (texture_end.x > canvas.b.x) {
                 texture_endcut.x = texture_end.x - canvas.b.x;
             }
             if (start.y < canvas.a.y) {
                 texture_start.y = (canvas.a.y - start.y);
                 start.y = canvas.a.y;
-            } else if (texture_end.y > canvas.b.y) {
+            }
+            if (texture_end.y > canvas.b.y) {
                 texture_endcut.y = texture_end.y - canvas.b.y;
             }
             
             unsigned* __restrict texture_pixels = (unsigned*)(texture + texture_start.y * texture_stride + texture_start.x); 
-            unsigned* __restrict screen_pixels = (unsigned*)(pixels + start.y * size.w + start.x);
+            unsigned* __restrict screen_pixels = (unsigned*)(pixels + start.y * stride + start.x);
             short upper_bound_x = texture_size.w - texture_start.x - texture_endcut.x;
             short upper_bound_y = texture_size.h - texture_start.y - texture_endcut.y;
             if (upper_bound_y > 0 && upper_bound_x > 0) {
                 if (transparent) {
                     for (short y = 0; y < upper_bound_y; y++) {
-                        for (short x = 0; x < upper_bound_x; x++) {
-                            unsigned color1 = screen_pixels[y * size.w + x];
-                            unsigned color2 = texture_pixels[y * texture_stride + x];
-                            unsigned rb = (color1 & 0xff00ff) + (((color2 & 0xff00ff) - (color1 & 0xff00ff)) * ((color2 & 0xff000000) >> 24) >> 8);
-                            unsigned g  = (color1 & 0x00ff00) + (((color2 & 0x00ff00) - (color1 & 0x00ff00)) * ((color2 & 0xff000000) >> 24) >> 8);
-                            screen_pixels[y * size.w + x] = (rb & 0xff00ff) | (g & 0x00ff00);
-                        }
+                        blend_row(screen_pixels + y * stride, screen_pixels + y * stride, texture_pixels + y * texture_stride, upper_bound_x);
                     }
                 } else {
                     for (short y = 0; y < upper_bound_y; y++) {
-                        std::memcpy(screen_pixels + y * size.w, texture_pixels + y * texture_stride, upper_bound_x * sizeof(unsigned));
+                        std::memcpy(screen_pixels + y * stride, texture_pixels + y * texture_stride, upper_bound_x * sizeof(unsigned));
                     }
                 }
             }
         }
 
-        void update() {
-            long long t_now = now();
-            long long t = t_now - last_update;
-            update_window();
-            m_fps = t > 0 ? (double) 1 / ((double)now() / (1000 * 1000)) : 0; 
-            last_update = now();
+        // nearest neighbour scaling in 16.16 fixed point, for zoom levels without a stored texture copy
+        void blit_scaled(Color* texture, Size texture_size, Point start, Size target_size, Box canvas, bool transparent) {
+            canvas = clip_to_target(canvas);
+            const int x1 = std::max(start.x, canvas.a.x);
+            const int x2 = std::min(start.x + target_size.w, (int)canvas.b.x);
+            const int y1 = std::max(start.y, canvas.a.y);
+            const int y2 = std::min(start.y + target_size.h, (int)canvas.b.y);
+            if (x1 >= x2 || y1 >= y2) {
+                return;
+            }
+            const long long step_x = ((long long)texture_size.w << 16) / target_size.w;
+            const long long step_y = ((long long)texture_size.h << 16) / target_size.h;
+            std::vector<unsigned> row(x2 - x1);
+            for (int y = y1; y < y2; y++) {
+                const unsigned* src = (unsigned*)texture + (((y - start.y) * step_y) >> 16) * texture_size.w;
+                long long u = (x1 - start.x) * step_x;
+                for (int x = 0; x < x2 - x1; x++, u += step_x) {
+                    row[x] = src[u >> 16];
+                }
+                unsigned* dst = (unsigned*)pixels + y * stride + x1;
+                if (transparent) {
+                    blend_row(dst, dst, row.data(), x2 - x1);
+                } else {
+                    std::memcpy(dst, row.data(), (x2 - x1) * sizeof(unsigned));
+                }
+            }
+        }
+
+        // blends the color over the canvas, rows are split across the thread pool for large areas
+        void blend_color(Color color, Box canvas) {
+            canvas = clip_to_target(canvas);
+            const int x1 = canvas.a.x;
+            const int x2 = canvas.b.x;
+            const int y1 = canvas.a.y;
+            const int y2 = canvas.b.y;
+            if (x1 >= x2 || y1 >= y2 || color.alpha == 0) {
+                return;
+            }
+            unsigned* dst = (unsigned*)pixels + x1;
+            const int row_stride = stride;
+            if ((x2 - x1) * (y2 - y1) < PARALLEL_BLEND_PIXELS) {
+                for (int y = y1; y < y2; y++) {
+                    blend_color_row(dst + y * row_stride, color, x2 - x1);
+                }
+                return;
+            }
+            parallel_for(y1, y2 - 1, [&](int y) { blend_color_row(dst + y * row_stride, color, x2 - x1); });
         }
 
+        // hands the finished frame to the window and continues drawing into the next buffer, with
+        // max_frames_in_flight > 0 a present thread copies it to the window surface while the next
+        // frames are prepared, present() only waits once that many frames are still being copied
+        void present();
+        // shows the frames the present thread copied so far, SDL is only called from the main thread
+        void show_presented() { show_copied(in_flight); }
+        // waits for every submitted frame and shows the last one, e.g. before the loop goes idle
+        void finish_present() { show_copied(0); }
+        void stop_present();
+
         int fps() { return m_fps; }
+        bool is_headless() { return headless; }
+
+        // writes the current frame as png or ppm, see write_image()
+        bool write_frame(const std::string& path) { return write_image(path, (Color*)pixels, size, stride); }
 
         int* pixels;
 
     private:
+        struct Submission {
+            int buffer;
+            std::vector<Box> changes;
+        };
+        int* surface = nullptr;
+        std::vector<int*> buffers;
+        std::vector<std::vector<Box>> stale; // per buffer, areas changed by frames drawn into the other buffers
+        std::vector<bool> buffer_busy; // submitted and not presented yet
+        int current = 0;
+        std::vector<Box> frame_changes;
+        std::thread present_thread;
+        std::mutex present_mutex;
+        std::condition_variable cv_present;
+        std::deque<Submission> present_queue;
+        bool stop_presenting = false;
+        int in_flight = 0;
+        int submitted = 0; // frames handed to the present thread
+        int copied = 0; // of those, frames in the window surface
+        int shown = 0;
+        std::mutex surface_mutex; // the present thread copies into the surface, the main thread shows it
+        Box graph_box; // profiler graph drawn over the surface, restored by the next copy
+
+        void present_loop();
+        void show_copied(int max_outstanding);
+        void copy_to_surface(int buffer, std::vector<Box> changes);
+        void show_frame();
+        void copy_rects(const int* src, int* dst, const std::vector<Box>& rects);
+
+        constexpr static int MAX_DAMAGE_RECTS = 32;
+        constexpr static int PARALLEL_BLEND_PIXELS = 64 * 1024;
         long long last_update = now();
         int m_fps = 0;
+        bool drawing = false;
+        bool headless = false;
+        int stride = size.w;
+        struct Target {
+            int* pixels;
+            int stride;
+            Box area;
+        };
+        std::vector<Target> targets;
+        Box target_area = Box(Point(0, 0), size); // the screen, or the layer drawn into
+
+        // empty boxes come out with b == a
+        Box clip_to_target(Box b) {
+            Point a(std::max(b.a.x, target_area.a.x), std::max(b.a.y, target_area.a.y));
+            Point c(std::min(b.b.x, target_area.b.x), std::min(b.b.y, target_area.b.y));
+            return Box(a, Point(std::max(a.x, c.x), std::max(a.y, c.y)));
+        }
+        std::vector<Box> damage_rects;
+        std::vector<Box> pending_damage;
+
+        void add_damage(std::vector<Box>& rects, Box b) {
+            b = Box(Point(std::max<int>(b.a.x, 0), std::max<int>(b.a.y, 0)), Point(std::min<int>(b.b.x, size.w), std::min<int>(b.b.y, size.h)));
+            if (b.a.x >= b.b.x || b.a.y >= b.b.y) {
+                return;
+            }
+            for (size_t i = 0; i < rects.size(); ) {
+                Box& r = rects[i];
+                if (r.a.x <= b.b.x && b.a.x <= r.b.x && r.a.y <= b.b.y && b.a.y <= r.b.y) {
+                    b = Box(Point(std::min(r.a.x, b.a.x), std::min(r.a.y, b.a.y)), Point(std::max(r.b.x, b.b.x), std::max(r.b.y, b.b.y)));
+                    rects.erase(rects.begin() + i);
+                    i = 0;
+                } else {
+                    i++;
+                }
+            }
+            rects.push_back(b);
+            if ((int)rects.size() > MAX_DAMAGE_RECTS) {
+                for (auto& r : rects) {
+                    b = Box(Point(std::min(r.a.x, b.a.x), std::min(r.a.y, b.a.y)), Point(std::max(r.b.x, b.b.x), std::max(r.b.y, b.b.y)));
+                }
+                rects = {b};
+            }
+        }
 };
 
 #endif
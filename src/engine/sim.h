@@ -12,6 +12,8 @@ class Simulation {
     };
 
     Simulation() {
+        time_table = Engine.db()->get_table<int>("simtime", KeyIndex::HASH);
+        event_table = Engine.db()->get_table<Slice>("events", KeyIndex::SORTED);
         reset();
     }
    
@@ -22,8 +24,8 @@ class Simulation {
         executing = true;
         int target = simtime() + t;
         std::vector<int> delete_slices;
-        Table<Slice>* table = Engine.db()->get_table<Slice>("events");
-        for (auto it = table->begin(); it != table->end(); ++it) {
+        auto rows = event_table->read_rows();
+        for (auto it = rows.begin(); it != rows.end(); ++it) {
             if (it.key() > target) {
                 break;
             }
@@ -34,9 +36,9 @@ class Simulation {
             delete_slices.push_back(it.key());
         }
         for (int slice : delete_slices) {
-            table->erase(slice);
+            event_table->erase(slice);
         }
-        Engine.db()->get_table<int>("simtime")->get(0) = target;
+        time_table->get(0) = target;
         executing = false;
         for (auto& e : queue) {
             queue_event(e.first, e.second);
@@ -56,24 +58,22 @@ class Simulation {
         }
         int t = simtime() + time_from_now; 
         int id = hash(name.c_str());
-        Table<Slice>* table = Engine.db()->get_table<Slice>("events");
-        if (!table->exists(t)) {
-            table->add(t);
+        if (!event_table->exists(t)) {
+            event_table->add(t);
         }
-        table->get(t).add(id);
+        event_table->get(t).add(id);
     }
     
-    int simtime() { return Engine.db()->get_table<int>("simtime")->get(0); }
+    int simtime() { return time_table->read(0); }
     
     void toggle(bool running) { run = running; }
     bool running() { return run; }
 
     void reset() {
-        Table<int>* table = Engine.db()->get_table<int>("simtime");
-        if (!table->exists(0)) {
-            table->add(0);
+        if (!time_table->exists(0)) {
+            time_table->add(0);
         }
-        table->get(0) = 0;
+        time_table->get(0) = 0;
     }
 
    private:
@@ -95,6 +95,9 @@ class Simulation {
         int events[DEPTH] = {0};
     };
 
+    Table<int>* time_table;
+    Table<Slice>* event_table;
+
     int hash(const char *str) {
         int h = 0;
         while (*str) {
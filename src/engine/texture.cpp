@@ -1,6 +1,8 @@
 #include "texture.h"
 #include "engine.h"
 #include "db.h"
+#include <mutex>
+#include <tuple>
 
 Texture::Texture(Size s, Color* pixels): m_size(s) {
     pixel_map[zoom2idx(1.0)] = pixels;
@@ -14,24 +16,60 @@ Texture::Texture(Color color, Size s): m_size(s) {
 }
 
 Texture::~Texture() {
-    for (Color* t : pixel_map) {
-        delete[] t;
+    for (int i = 0; i < 6; i++) {
+        if (i != zoom2idx(1.0)) {
+            free_scaled(i);
+        }
     }
+    delete[] pixel_map[zoom2idx(1.0)].load();
+    delete[] m_block_colors;
 }
 
-Color* Texture::load_scaled(float zoom) {
+static std::mutex scale_mutex;
+
+// colors weighted by alpha so transparent pixels do not darken the edges
+static Color average(const Color* src, int stride, int w, int h) {
+    unsigned r = 0, g = 0, b = 0, a = 0;
+    for (int i = 0; i < h; i++) {
+        for (int j = 0; j < w; j++) {
+            Color c = src[i * stride + j];
+            r += c.red * c.alpha;
+            g += c.green * c.alpha;
+            b += c.blue * c.alpha;
+            a += c.alpha;
+        }
+    }
+    Color out(0, 0, 0, a / (w * h));
+    if (a) {
+        out.red = r / a;
+        out.green = g / a;
+        out.blue = b / a;
+    }
+    return out;
+}
+
+Color* Texture::load_scaled(int zoom_level) {
+    std::lock_guard<std::mutex> lock(scale_mutex);
+    if (pixel_map[zoom_level]) {
+        return pixel_map[zoom_level]; // another thread was faster
+    }
+    float zoom = idx2zoom(zoom_level);
     int fact = (double)1 / zoom;
     int izoom = (int)zoom;
-    Color* src = pixels();
-    Color* pixels = new Color[static_cast<int>(m_size.w * zoom * m_size.h * zoom)];
-    for (int y = 0; y < m_size.h; y++) {
-        for (int x = 0; x < m_size.w; x++) {
-            int srcidx =  y * m_size.w + x;
-            if (zoom < 1) {
-                if (x % fact == 0 && y % fact == 0) {
-                    pixels[y/fact * m_size.w/fact + x/fact] = src[srcidx];
-                }
-            } else {
+    Color* src = pixel_map[zoom2idx(1.0)];
+    Size s = size(zoom);
+    Color* pixels = new Color[s.w * s.h];
+    if (zoom < 1) {
+        // box filter
+        for (int y = 0; y < s.h; y++) {
+            for (int x = 0; x < s.w; x++) {
+                pixels[y * s.w + x] = average(src + y * fact * m_size.w + x * fact, m_size.w, fact, fact);
+            }
+        }
+    } else {
+        for (int y = 0; y < m_size.h; y++) {
+            for (int x = 0; x < m_size.w; x++) {
+                int srcidx =  y * m_size.w + x;
                 for (int i = 0; i < izoom; i++) {
                     for (int j = 0; j < izoom; j++) {
                         pixels[(i+y*izoom) * m_size.w*izoom + x*izoom + j] = src[srcidx];
@@ -40,10 +78,39 @@ Color* Texture::load_scaled(float zoom) {
             }
         }
     }
-    pixel_map[zoom2idx(zoom)] = pixels;
+    scaled_bytes += (long long)s.w * s.h * sizeof(Color);
+    pixel_map[zoom_level].store(pixels, std::memory_order_release);
     return pixels;
 }
 
+const Color* Texture::block_colors(Size block) {
+    std::lock_guard<std::mutex> lock(scale_mutex);
+    if (m_block_colors && m_block_size.w == block.w && m_block_size.h == block.h) {
+        return m_block_colors;
+    }
+    delete[] m_block_colors;
+    const Color* src = pixel_map[zoom2idx(1.0)];
+    Size blocks(std::max(1, m_size.w / block.w), std::max(1, m_size.h / block.h));
+    Size b(std::min(block.w, m_size.w), std::min(block.h, m_size.h));
+    m_block_colors = new Color[blocks.w * blocks.h];
+    for (int y = 0; y < blocks.h; y++) {
+        for (int x = 0; x < blocks.w; x++) {
+            m_block_colors[y * blocks.w + x] = average(src + y * b.h * m_size.w + x * b.w, m_size.w, b.w, b.h);
+        }
+    }
+    m_block_size = block;
+    return m_block_colors;
+}
+
+void Texture::free_scaled(int zoom_level) {
+    Color* pixels = pixel_map[zoom_level].exchange(nullptr);
+    if (pixels) {
+        Size s = size(idx2zoom(zoom_level));
+        scaled_bytes -= (long long)s.w * s.h * sizeof(Color);
+        delete[] pixels;
+    }
+}
+
 
 
 
@@ -169,23 +236,29 @@ static Texture* generate_debris(Size s, Color, Color, Color, int size_clusters,
 
 
 TextureManager::TextureManager() {
-    letter_to_texture.resize(1024);
+    atlases.resize(1024);
+    auto& settings = Engine.config("settings");
+    if (settings.contains("texture_cache_mb")) {
+        scaled_budget = (long long)settings["texture_cache_mb"].i() * 1024 * 1024;
+    }
 }
 
 TextureManager::~TextureManager() {
     for (auto& pair : name_to_texture) {
         delete pair.second;
     }
-    for (auto& sizes : letter_to_texture) {
-        for (auto t : sizes) {
-            delete t;
-        }
+    for (auto& atlas : atlases) {
+        delete atlas.texture;
+    }
+    for (auto& text : text_cache) {
+        delete text.second.first;
     }
 }
 
 void TextureManager::reinit() {
     auto table = Engine.db()->get_table<String<256>>("textures");
-    for (auto it = table->begin(); it != table->end(); ++it) {
+    auto rows = table->read_rows();
+    for (auto it = rows.begin(); it != rows.end(); ++it) {
         Texture::ID id = it.key();
         std::string name = (*it).toStdString();
         Texture* t = nullptr;
@@ -206,8 +279,39 @@ void TextureManager::register_texture(const std::string& name, Texture* t) {
     name_to_texture[name] = t;
     Engine.db()->get_table<String<256>>("textures")->add(currentID, name);
     currentID++;
-    for (float z : {0.125, 0.25, 0.5, 2.0, 4.0}) {
-        t->load_scaled(z);
+}
+
+void TextureManager::trim() {
+    int frame = Texture::use_counter.fetch_add(1, std::memory_order_relaxed);
+    if ((int)text_cache.size() > MAX_CACHED_TEXTS) {
+        for (auto it = text_cache.begin(); it != text_cache.end(); ) {
+            if (it->second.second < frame) {
+                delete it->second.first;
+                it = text_cache.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    if (Texture::scaled_bytes <= scaled_budget) {
+        return;
+    }
+    // least recently used zoom levels first, but never the ones drawn in the last frame
+    std::vector<std::tuple<int, int, Texture*>> candidates;
+    for (Texture::ID id = 1; id < currentID; id++) {
+        Texture* t = id_to_texture[id];
+        for (int i = 0; t && i < 6; i++) {
+            if (i != Texture::zoom2idx(1.0) && t->pixel_map[i] && t->last_use[i] < frame) {
+                candidates.emplace_back(t->last_use[i], i, t);
+            }
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    for (auto& c : candidates) {
+        if (Texture::scaled_bytes <= scaled_budget) {
+            break;
+        }
+        std::get<2>(c)->free_scaled(std::get<1>(c));
     }
 }
 
@@ -252,11 +356,52 @@ Texture* TextureManager::get(const std::string& name) {
     return generate_texture(name);
 }
 
-Texture* TextureManager::get(char letter, int size) {
-    if (letter_to_texture[size].empty()) {
-        init_letters(size);
+const Box* TextureManager::glyph(char letter, int height) {
+    if (letter < FIRST_LETTER || letter > LAST_LETTER || height <= 0 || height >= (int)atlases.size()) {
+        return nullptr;
+    }
+    GlyphAtlas& atlas = atlases[height].texture ? atlases[height] : init_letters(height);
+    return atlas.glyphs.empty() ? nullptr : &atlas.glyphs[letter - FIRST_LETTER];
+}
+
+Texture* TextureManager::get_text(const std::string& line, int height) {
+    auto key = std::make_pair(height, line);
+    auto it = text_cache.find(key);
+    if (it != text_cache.end()) {
+        it->second.second = Texture::use_counter.load(std::memory_order_relaxed);
+        return it->second.first;
     }
-    return letter_to_texture[size][letter]; 
+    Size s(0, 0);
+    for (char c : line) {
+        const Box* g = glyph(c, height);
+        if (g) {
+            s.w += g->b.x - g->a.x;
+            s.h = std::max<int>(s.h, g->b.y - g->a.y);
+        }
+    }
+    if (s.w == 0 || s.h == 0) {
+        return nullptr;
+    }
+    // the glyphs do not overlap, so copying them gives the same result as blending them one by one
+    Color* pixels = new Color[s.w * s.h];
+    Texture* atlas = atlases[height].texture;
+    Color* atlas_pixels = atlas->pixels();
+    int x = 0;
+    for (char c : line) {
+        const Box* g = glyph(c, height);
+        if (!g) {
+            continue;
+        }
+        const int w = g->b.x - g->a.x;
+        for (int y = 0; y < g->b.y - g->a.y; y++) {
+            std::memcpy(pixels + y * s.w + x, atlas_pixels + (g->a.y + y) * atlas->size().w + g->a.x, w * sizeof(Color));
+        }
+        x += w;
+    }
+    Texture* t = new Texture(s, pixels);
+    t->set_transparent(true);
+    text_cache[key] = {t, Texture::use_counter.load(std::memory_order_relaxed)};
+    return t;
 }
 
 static const std::string EMPTY_PARAM = "EMPTY_PARAM";
@@ -380,12 +525,34 @@ Texture* TextureManager::get_alpha_bordered(const std::string& basename, const s
     return gen_texture;
 }
 
-void TextureManager::init_letters(int height, Color color) {
-    char start = 32;
-    char end = 127;
-    letter_to_texture[height].resize(end + 1);
-    auto letters = load_letters(fontpath, height, color, start, end);
+TextureManager::GlyphAtlas& TextureManager::init_letters(int height, Color color) {
+    GlyphAtlas& atlas = atlases[height];
+    auto letters = load_letters(fontpath, height, color, FIRST_LETTER, LAST_LETTER + 1);
+    // rows of glyphs, each row as high as its highest glyph
+    int atlas_width = ATLAS_WIDTH;
+    for (auto& letter : letters) {
+        atlas_width = std::max<int>(atlas_width, letter.second.w);
+    }
+    int x = 0, y = 0, row_height = 0;
     for (auto& letter : letters) {
-        letter_to_texture[height][start++] = new Texture(letter.second, letter.first);
+        if (x + letter.second.w > atlas_width) {
+            x = 0;
+            y += row_height;
+            row_height = 0;
+        }
+        atlas.glyphs.emplace_back(Point(x, y), letter.second);
+        x += letter.second.w;
+        row_height = std::max<int>(row_height, letter.second.h);
+    }
+    Size s(atlas_width, std::max(1, y + row_height));
+    Color* pixels = new Color[s.w * s.h];
+    for (int i = 0; i < (int)letters.size(); i++) {
+        Box& g = atlas.glyphs[i];
+        for (int row = 0; row < letters[i].second.h; row++) {
+            std::memcpy(pixels + (g.a.y + row) * s.w + g.a.x, letters[i].first + row * letters[i].second.w, letters[i].second.w * sizeof(Color));
+        }
+        delete[] letters[i].first;
     }
+    atlas.texture = new Texture(s, pixels);
+    return atlas;
 }
\ No newline at end of file
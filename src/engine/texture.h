@@ -2,6 +2,7 @@
 #define TEXTURE_H
 
 #include "engine.h"
+#include <atomic>
 
 class Texture {
     public:
@@ -19,7 +20,23 @@ class Texture {
             if (zoom == 2.0f) return 4;
             return 5;
         }
-        inline Color* pixels(float zoom = 1.0f) { return pixel_map[zoom2idx(zoom)]; }
+        static inline float idx2zoom(int zoom_level) { return 0.125f * (1 << zoom_level); }
+        // smallest stored zoom level that is at least as detailed as the given zoom
+        static inline int mip_level(float zoom) {
+            int zoom_level = 0;
+            while (zoom_level < 5 && idx2zoom(zoom_level) < zoom) zoom_level++;
+            return zoom_level;
+        }
+        static inline bool is_mip(float zoom) { return idx2zoom(mip_level(zoom)) == zoom; }
+        inline Color* pixels(float zoom = 1.0f) { return pixels_at(zoom2idx(zoom)); }
+        // scaled levels are created on first use and may be evicted again by TextureManager::trim()
+        inline Color* pixels_at(int zoom_level) {
+            last_use[zoom_level].store(use_counter.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            Color* p = pixel_map[zoom_level].load(std::memory_order_acquire);
+            return p ? p : load_scaled(zoom_level);
+        }
+        // alpha weighted average color of each block of the given size, row by row
+        const Color* block_colors(Size block);
         Size size(float zoom = 1) { return m_size * zoom; }
         bool transparent() { return hasTransparency; }
         void set_transparent(bool b) { hasTransparency = b; }   
@@ -30,9 +47,15 @@ class Texture {
         friend class Tilemap;
         ID m_id = 0;
         Size m_size;
-        Color* pixel_map[6] = {nullptr};
+        std::atomic<Color*> pixel_map[6] = {};
+        std::atomic<int> last_use[6] = {};
         bool hasTransparency = false;
-        Color* load_scaled(float zoom);
+        Color* m_block_colors = nullptr;
+        Size m_block_size = {0, 0};
+        inline static std::atomic<int> use_counter{0}; // advanced by trim() while render workers read it
+        inline static std::atomic<long long> scaled_bytes{0};
+        Color* load_scaled(int zoom_level);
+        void free_scaled(int zoom_level);
 };
 
 class TextureManager {
@@ -44,9 +67,13 @@ class TextureManager {
         void add_folder(const std::string& folder);
         inline Texture* get(Texture::ID id) { return id_to_texture[id]; }
         Texture* get(const std::string& name);
-        Texture* get(char letter, int size);
+        // area of the letter in the glyph atlas of the given height, nullptr if the font has no glyph for it
+        const Box* glyph(char letter, int height);
+        // one line of text as a single bitmap, cached until it was not used for a frame and the cache is full
+        Texture* get_text(const std::string& line, int height);
         std::string generate_name(const std::string& command, const std::vector<std::string>& params);
         void set_font(const std::string& path) { fontpath = path; }
+        void trim();
 
     private:
         friend class Tilemap;
@@ -54,12 +81,22 @@ class TextureManager {
         constexpr static char DELIMITER = '$';
         Texture* id_to_texture[15000] = {0};
         std::map<std::string, Texture*> name_to_texture;
-        std::vector<std::vector<Texture*>> letter_to_texture;
+        constexpr static char FIRST_LETTER = 32;
+        constexpr static char LAST_LETTER = 126;
+        constexpr static int MAX_CACHED_TEXTS = 256;
+        constexpr static int ATLAS_WIDTH = 1024;
+        struct GlyphAtlas {
+            Texture* texture = nullptr;
+            std::vector<Box> glyphs;
+        };
+        std::vector<GlyphAtlas> atlases;
+        std::map<std::pair<int, std::string>, std::pair<Texture*, int>> text_cache;
         Texture::ID currentID = 1;
+        long long scaled_budget = 128 * 1024 * 1024;
         Texture* generate_texture(const std::string& name);
         Texture* get_blended(const std::string& base, const std::string& top, const std::string& right, const std::string& bottom, const std::string& left);
         Texture* get_alpha_bordered(const std::string& basename, const std::string& postfix);
-        void init_letters(int height, Color color = {255, 255, 255});
+        GlyphAtlas& init_letters(int height, Color color = {255, 255, 255});
 };
 
 #endif
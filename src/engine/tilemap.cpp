@@ -1,10 +1,85 @@
 #include "tilemap.h"
 #include "mapgen.h"
+#include <list>
+#include <unordered_map>
 
-#define groundid_get(x, y) (Texture::ID)(tiles->get(x, y) & 0x0000FFFF)
+#define groundid_get(x, y) (Texture::ID)(tiles->read(x, y) & 0x0000FFFF)
 #define groundid_set(x, y, v) tiles->get(x, y) = (tiles->get(x, y) & 0xFFFF0000) | (unsigned)(((unsigned short)v) & 0x0000FFFF)
-#define aboveid_get(x, y) (Texture::ID)((tiles->get(x, y) & 0xFFFF0000) >> 16)
+#define aboveid_get(x, y) (Texture::ID)((tiles->read(x, y) & 0xFFFF0000) >> 16)
 #define aboveid_set(x, y, v) tiles->get(x, y) = (tiles->get(x, y) & 0x0000FFFF) | (unsigned)((((unsigned short)v) & 0x0000FFFF) << 16)
+#define rootoffset_set(x, y, dx, dy) root_offsets->get(x, y) = (unsigned short)(((dy) << 8) | (dx))
+
+// LRU cache of pre-composited chunks, keyed by zoom level and chunk position
+class ChunkCache {
+    public:
+        ChunkCache(long long max_bytes): budget(max_bytes) {}
+        ~ChunkCache() { clear(); }
+
+        unsigned* get(int zoom_level, int cx, int cy) {
+            auto it = chunks.find(key(zoom_level, cx, cy));
+            if (it == chunks.end()) {
+                return nullptr;
+            }
+            lru.splice(lru.begin(), lru, it->second.lru);
+            it->second.pass = current_pass;
+            return it->second.pixels;
+        }
+
+        unsigned* add(int zoom_level, int cx, int cy, int num_pixels) {
+            long long bytes = (long long)num_pixels * sizeof(unsigned);
+            // chunks of the running pass are still referenced and may push it over budget temporarily
+            while (!lru.empty() && used + bytes > budget && chunks[lru.back()].pass != current_pass) {
+                erase(lru.back());
+            }
+            long long k = key(zoom_level, cx, cy);
+            lru.push_front(k);
+            Chunk& chunk = chunks[k];
+            chunk.pixels = new unsigned[num_pixels];
+            chunk.bytes = bytes;
+            chunk.lru = lru.begin();
+            chunk.pass = current_pass;
+            used += bytes;
+            return chunk.pixels;
+        }
+
+        void invalidate(int zoom_level, int cx, int cy) {
+            long long k = key(zoom_level, cx, cy);
+            if (chunks.find(k) != chunks.end()) {
+                erase(k);
+            }
+        }
+
+        void begin_pass() { current_pass++; }
+
+        void clear() {
+            while (!lru.empty()) {
+                erase(lru.back());
+            }
+        }
+
+    private:
+        struct Chunk {
+            unsigned* pixels = nullptr;
+            long long bytes = 0;
+            long long pass = 0;
+            std::list<long long>::iterator lru;
+        };
+        std::unordered_map<long long, Chunk> chunks;
+        std::list<long long> lru;
+        long long budget;
+        long long used = 0;
+        long long current_pass = 0;
+
+        static long long key(int zoom_level, int cx, int cy) { return ((long long)zoom_level << 48) | ((long long)(cy & 0xFFFFFF) << 24) | (cx & 0xFFFFFF); }
+
+        void erase(long long k) {
+            auto it = chunks.find(k);
+            delete[] it->second.pixels;
+            used -= it->second.bytes;
+            lru.erase(it->second.lru);
+            chunks.erase(it);
+        }
+};
 
 class MapNavigation : public Input::Listener {
     public:
@@ -18,6 +93,7 @@ class MapNavigation : public Input::Listener {
             key_zoomin = cfg["keys"]["zoomin"].s();
             key_zoomout = cfg["keys"]["zoomout"].s();
             key_quit = cfg["keys"]["quit"].s();
+            zoom_step = cfg.contains("zoom_step") ? cfg["zoom_step"].d() : 2.0;
             Engine.input()->add_key_listeners(this, {key_up, key_down, key_left, key_right});
             Engine.input()->add_key_listeners(this, {key_zoomin, key_zoomout, key_quit});
         }
@@ -32,33 +108,88 @@ class MapNavigation : public Input::Listener {
             } else if (key == key_right) {
                 Engine.map()->move_cam({accel, 0});
             } else if (key == key_zoomin) {
-                Engine.map()->zoom_cam(2);
+                Engine.map()->zoom_cam(zoom_step);
             } else if (key == key_zoomout) {
-                Engine.map()->zoom_cam(-2);
+                Engine.map()->zoom_cam(1 / zoom_step);
             } else if (key == key_quit) {
                 exit(0);
             }
         }
 
         int accel = 1;
+        double zoom_step = 2.0;
         std::string key_up, key_down, key_left, key_right, key_zoomin, key_zoomout, key_quit;
 };
 
 
 void Tilemap::create_map(Size screen_size) {
     auto& settings = Engine.config("settings");
+    delete map_stream;
+    map_stream = nullptr;
     map_size = {settings["mapsize"]["width"].i(), settings["mapsize"]["height"].i()};
     tile_dim = {settings["tilesize"]["width"].i(), settings["tilesize"]["height"].i()};
     size = screen_size;
-    tiles = Engine.db()->get_matrix<unsigned>("tiles", map_size.w, map_size.h);
+    const long long chunk_bytes = ChunkedMatrix<unsigned>::CHUNK_ELEMS * (2 * sizeof(unsigned) + sizeof(unsigned short));
+    max_chunks = settings.contains("map_resident_mb") ? settings["map_resident_mb"].i() * 1024LL * 1024 / chunk_bytes : 0;
+    tiles = Engine.db()->get_chunked_matrix<unsigned>("tiles", map_size.w, map_size.h, max_chunks);
+    build_root_offsets();
+    delete tile_colors;
+    tile_colors = new ChunkedMatrix<unsigned>("tile_colors", map_size.w, map_size.h, max_chunks);
+    update_tile_colors({0, 0}, map_size);
     infinite_scrolling = settings["infinite_scrolling"].i();
     use_fast_renderer = (bool)(settings["use_fast_renderer"].i());
+    delete chunk_cache;
+    chunk_cache = nullptr;
+    if (settings.contains("chunk_cache_mb") && settings["chunk_cache_mb"].i() > 0) {
+        chunk_cache = new ChunkCache((long long)settings["chunk_cache_mb"].i() * 1024 * 1024);
+    }
+    invalidate();
     for (auto& listener : click_listeners) {
         listener->map_changed();
     }
     new MapNavigation();
 }
 
+void Tilemap::build_root_offsets() {
+    delete root_offsets;
+    root_offsets = new ChunkedMatrix<unsigned short>("root_offsets", map_size.w, map_size.h, max_chunks);
+    for (short y = 0; y < map_size.h; y++) {
+        for (short x = 0; x < map_size.w; x++) {
+            Texture::ID id = aboveid_get(x, y);
+            if (id <= 0) {
+                continue;
+            }
+            Size s = Engine.textures()->get(id)->size() / tile_dim;
+            for (short y2 = y; y2 < y + s.h && y2 < map_size.h; y2++) {
+                for (short x2 = x; x2 < x + s.w && x2 < map_size.w; x2++) {
+                    if (aboveid_get(x2, y2) == -id) {
+                        rootoffset_set(x2, y2, x2 - x, y2 - y);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void Tilemap::update_tile_colors(Point p, Size s) {
+    Texture** textures_map = Engine.textures()->id_to_texture;
+    for (int y = p.y; y < p.y + s.h && y < map_size.h; y++) {
+        for (int x = p.x; x < p.x + s.w && x < map_size.w; x++) {
+            Texture::ID ground_id = groundid_get(x, y);
+            Texture* ground = textures_map[ground_id < 0 ? -ground_id : ground_id];
+            unsigned color = ground ? (unsigned)ground->block_colors(tile_dim)[0] : 0;
+            Texture::ID above_id = aboveid_get(x, y);
+            Texture* above = textures_map[above_id < 0 ? -above_id : above_id];
+            if (above_id && above) {
+                unsigned short offset = above_id < 0 ? root_offsets->read(x, y) : 0;
+                unsigned above_color = above->block_colors(tile_dim)[(offset >> 8) * (above->m_size.w / tile_dim.w) + (offset & 0xFF)];
+                blend_row(&color, &color, &above_color, 1);
+            }
+            tile_colors->get(x, y) = color;
+        }
+    }
+}
+
 Texture::ID Tilemap::get_ground(Point p) { 
     Texture::ID id = groundid_get(p.x, p.y); 
     return id < 0 ? -id : id; 
@@ -66,6 +197,7 @@ Texture::ID Tilemap::get_ground(Point p) {
 
 bool Tilemap::set_ground(Texture::ID id, Point p, bool blocked) {
     groundid_set(p.x, p.y, blocked ? -id : id);
+    damage_tiles(p, {1, 1});
     return true;
 }
 
@@ -75,6 +207,7 @@ bool Tilemap::set_ground(const std::string& texture_name, Point p, bool blocked)
     }
     Texture* texture = Engine.textures()->get(texture_name);
     groundid_set(p.x, p.y, blocked ? -texture->id() : texture->id());
+    damage_tiles(p, {1, 1});
     return true;
 }
 
@@ -84,13 +217,13 @@ bool Tilemap::set_tile(const std::string& texture_name, Point p) {
     return set_tile(texture->id(), p, s);
 }
 
-bool Tilemap::set_tile(Texture::ID id, Point p, Size s) {
-    if (p.x + s.w >= map_size.w || p.y + s.h >= map_size.h) {
+bool Tilemap::set_tile(Texture::ID id, Point p, Size s, bool check_ground) {
+    if (p.x + s.w >= map_size.w || p.y + s.h >= map_size.h || s.w > 256 || s.h > 256) {
         return false;
     }
     for (short y = p.y; y < p.y + s.h; y++) {
         for (short x = p.x; x < p.x + s.w; x++) {
-            if (groundid_get(x, y) < 0 || aboveid_get(x, y) != 0) {
+            if ((check_ground && groundid_get(x, y) < 0) || aboveid_get(x, y) != 0) {
                 return false;
             }
         }
@@ -98,23 +231,18 @@ bool Tilemap::set_tile(Texture::ID id, Point p, Size s) {
     for (short y = p.y; y < p.y + s.h; y++) {
         for (short x = p.x; x < p.x + s.w; x++) {
             aboveid_set(x, y, x == p.x && y == p.y ? id : -id);
+            rootoffset_set(x, y, x - p.x, y - p.y);
         }
     }
+    damage_tiles(p, s);
     return true;
 }
 
 Point Tilemap::texture_root(Point p) {
     Texture::ID id = aboveid_get(p.x, p.y);
     if (id < 0) {
-        Size s = Engine.textures()->get(-id)->size() / tile_dim;
-        for (short y = p.y; y > p.y - s.h && y >= 0; y--) { 
-            for (short x = p.x; x > p.x - s.w && x >= 0 ; x--) {
-                Texture::ID current_id = aboveid_get(x, y);
-                if (current_id == -id) {
-                    return {x, y, map_size};
-                }
-            }
-        }
+        unsigned short offset = root_offsets->read(p.x, p.y);
+        return Point(p.x - (offset & 0xFF), p.y - (offset >> 8));
     }
     return p;
 }
@@ -130,12 +258,43 @@ void Tilemap::unset_tile(Point ps) {
         for (short x = p.x; x < p.x + s.w; x++) {
             if ((x == p.x && y == p.y) || aboveid_get(x, y) < 0) {
                 aboveid_set(x, y, 0);
+                rootoffset_set(x, y, 0, 0);
             }
         }
     }
+    damage_tiles(p, s);
+}
+
+void Tilemap::damage_tiles(Point p, Size s) {
+    // MapGen edits from worker threads, the caches are dropped as a whole afterwards
+    if (generating) {
+        return;
+    }
+    dirty = true;
+    update_tile_colors(p, s);
+    if (chunk_cache) {
+        for (int zoom_level = 0; zoom_level < 6; zoom_level++) {
+            int n = chunk_tiles(0.125f * (1 << zoom_level));
+            for (int cy = p.y / n; cy <= (p.y + s.h - 1) / n; cy++) {
+                for (int cx = p.x / n; cx <= (p.x + s.w - 1) / n; cx++) {
+                    chunk_cache->invalidate(zoom_level, cx, cy);
+                }
+            }
+        }
+    }
+    // nothing to track while a full redraw is pending anyway
+    if (!framebuffer_valid) {
+        return;
+    }
+    if ((int)damaged_tiles.size() >= MAX_DAMAGED_TILES) {
+        framebuffer_valid = false;
+        return;
+    }
+    damaged_tiles.emplace_back(p, s);
 }
 
 void Tilemap::move_cam(Point p) {
+    Engine.request_frame();
     if ((p.x != 0 && move_vector.x == 0)) {
         move_vector.x = p.x;
         set_update(true);
@@ -152,22 +311,28 @@ void Tilemap::move_cam_to_tile(Point tile_pos) {
     Camera mid = {zoom * tile_dim.w * (visible.b.x - visible.a.x) / 2, zoom * tile_dim.h * (visible.b.y - visible.a.y) / 2};
     camera_pos = camera_pos - mid;
     fix_camera();
+    set_update(true);
 }
 
-void Tilemap::zoom_cam(int factor) {
-    if (factor > 0 && zoom * factor <= MAX_ZOOM) {
-        camera_pos.x = (camera_pos.x + size.w / 4) * factor;
-        camera_pos.y = (camera_pos.y + size.h / 4) * factor;
-        zoom *= factor;
-        fix_camera();
-        set_update(true);
-    } else if (zoom * -((double)1/factor) >= MIN_ZOOM) {
-        camera_pos.x = (camera_pos.x - size.w / 2) / (-factor);
-        camera_pos.y = (camera_pos.y - size.h / 2) / (-factor);
-        zoom *= -((double)1/factor);
-        fix_camera();
-        set_update(true);
+void Tilemap::zoom_cam(float factor) {
+    float new_zoom = zoom * factor;
+    if (new_zoom > MAX_ZOOM + 0.001 || new_zoom < MIN_ZOOM - 0.001) {
+        return;
+    }
+    // snap to stored zoom levels, so repeated fractional steps return to the cached renderer
+    float mip = Texture::idx2zoom(Texture::mip_level(new_zoom));
+    if (std::abs(mip - new_zoom) < 0.01 * mip) {
+        new_zoom = mip;
+    } else if (Texture::mip_level(new_zoom) > 0 && std::abs(mip / 2 - new_zoom) < 0.005 * mip) {
+        new_zoom = mip / 2;
     }
+    factor = new_zoom / zoom;
+    // keep the center of the view in place
+    camera_pos.x = (camera_pos.x + size.w / 2) * factor - size.w / 2;
+    camera_pos.y = (camera_pos.y + size.h / 2) * factor - size.h / 2;
+    zoom = new_zoom;
+    fix_camera();
+    set_update(true);
 }
 
 Box Tilemap::visible_tiles() {
@@ -180,20 +345,86 @@ Box Tilemap::visible_tiles() {
 }
 
 void Tilemap::randomize_map() {
+    delete map_stream;
+    map_stream = nullptr;
+    invalidate();
+    if (chunk_cache) {
+        chunk_cache->clear();
+    }
     for (auto& listener : click_listeners) {
         listener->map_changed();
     }
-    for (short y_map = 0; y_map < map_size.h; y_map++) {
-        for (short x_map = 0; x_map < map_size.w; x_map++) {
-            tiles->get(x_map, y_map) = 0;
-        }
+    auto& settings = Engine.config("settings");
+    MapStream* stream = settings.contains("stream_mapgen") && settings["stream_mapgen"].i() ? new MapStream(map_size, tile_dim) : nullptr;
+    // a streamed map is covered with the lowest ground until its chunks are generated
+    unsigned empty_tile = 0;
+    if (stream) {
+        auto& placeholder = stream->map_gen().placeholder();
+        Texture::ID id = placeholder.biomes[0].id();
+        empty_tile = (unsigned short)(placeholder.blocking ? -id : id);
+    }
+    tiles->fill(empty_tile);
+    root_offsets->fill(0);
+    if (!stream) {
+        generating = true;
+        MapGen(map_size, tile_dim).generate_map();
+        generating = false;
+        update_tile_colors({0, 0}, map_size);
+        return;
     }
-    MapGen::randomize_map();
+    update_tile_colors({0, 0}, {1, 1});
+    tile_colors->fill(tile_colors->read(0, 0));
+    map_stream = stream;
+    stream_camera = camera_pos;
+    stream_map();
+}
+
+void Tilemap::stream_map() {
+    if (!map_stream) {
+        return;
+    }
+    const Point ahead((camera_pos.x - stream_camera.x) * STREAM_LOOKAHEAD / (tile_dim.w * zoom), (camera_pos.y - stream_camera.y) * STREAM_LOOKAHEAD / (tile_dim.h * zoom));
+    stream_camera = camera_pos;
+    generating = true;
+    const std::vector<Box> applied = map_stream->update(visible_tiles(), ahead);
+    generating = false;
+    for (auto b : applied) {
+        damage_tiles(b.a, b.size());
+    }
+    if (!map_stream->finished()) {
+        Engine.request_frame();
+        return;
+    }
+    delete map_stream;
+    map_stream = nullptr;
+    for (auto& listener : click_listeners) {
+        listener->map_changed();
+    }
+}
+
+void Tilemap::finish_map() {
+    if (!map_stream) {
+        return;
+    }
+    generating = true;
+    map_stream->finish();
+    generating = false;
+    damage_tiles({0, 0}, map_size);
+    stream_map();
 }
 
 void Tilemap::mouse_clicked(Point p) {
     Camera click_pos = camera_pos + p - pos;
     Point click_tile(click_pos.x / (tile_dim.w * zoom), click_pos.y / (tile_dim.h * zoom), map_size);
+    if (map_stream) {
+        // the listeners see the generated tile
+        generating = true;
+        Box b = map_stream->require(click_tile);
+        generating = false;
+        if (b.a.x != b.b.x) {
+            damage_tiles(b.a, b.size());
+        }
+    }
     for (auto& l : click_listeners) {
         l->tile_clicked(click_tile);
     }
@@ -202,10 +433,14 @@ void Tilemap::mouse_clicked(Point p) {
 void Tilemap::fix_camera() {
     Camera camera_max = {(zoom * tile_dim.w) * map_size.w - size.w, (zoom * tile_dim.h) * map_size.h - size.h};
     if (infinite_scrolling) {
+        Camera old_pos = camera_pos;
         while (camera_pos.x <= -camera_max.x) camera_pos.x += (camera_max.x + size.w);
         while (camera_pos.y <= -camera_max.y) camera_pos.y += (camera_max.y + size.h);
         while (camera_pos.x >= 2 * camera_max.x) camera_pos.x -= (camera_max.x + size.w);
         while (camera_pos.y >= 2 * camera_max.y) camera_pos.y -= (camera_max.y + size.h);
+        if (camera_pos.x != old_pos.x || camera_pos.y != old_pos.y) {
+            framebuffer_valid = false; // wrapped around, the previous frame is no valid scroll source
+        }
     } else {
         if (camera_pos.x < 0) camera_pos.x = 0;
         if (camera_pos.y < 0) camera_pos.y = 0;
@@ -214,28 +449,56 @@ void Tilemap::fix_camera() {
     }
 }
 
+void Tilemap::focus_camera() {
+    const Box visible = visible_tiles();
+    tiles->set_focus(0, visible.a.x, visible.a.y, visible.b.x, visible.b.y);
+    root_offsets->set_focus(0, visible.a.x, visible.a.y, visible.b.x, visible.b.y);
+    tile_colors->set_focus(0, visible.a.x, visible.a.y, visible.b.x, visible.b.y);
+}
+
 void Tilemap::draw() {
     if (!listener_registered) {
         Engine.input()->add_mouse_listener(this, {pos, size});
         listener_registered = true;
     }
 
+    stream_map();
     Texture* t_cursor = Engine.textures()->get(cursor_texture);
     Box canvas(pos, size);
-    Point mpos = mouse_pos();
+    Point mpos = Engine.input()->mouse();
     bool do_update = t_cursor && canvas.inside(mpos) && mpos != last_mouse_pos;
+    // parts of the map that other composites uncovered or painted over
+    const std::vector<Box> exposed = Engine.screen()->damaged(canvas);
 
-    if (needs_update() || do_update) {
+    if (dirty || do_update || (!exposed.empty() && !use_fast_renderer)) {
         if (move_vector.x == move_vector.y) {
             move_vector.x = sqrt(move_vector.x * move_vector.x + move_vector.y * move_vector.y);
             move_vector.x = move_vector.y;
         }
         camera_pos = camera_pos + move_vector;
         fix_camera();
+        focus_camera();
         move_vector = {0, 0};
+        if (camera_pos.x != listener_camera_pos.x || camera_pos.y != listener_camera_pos.y || zoom != listener_zoom) {
+            listener_camera_pos = camera_pos;
+            listener_zoom = zoom;
+            for (auto& listener : click_listeners) {
+                listener->camera_moved();
+            }
+        }
 
         if (use_fast_renderer) {
-            fast_render();
+            if (!exposed.empty() && (camera_pos.x != last_camera_pos.x || camera_pos.y != last_camera_pos.y || zoom != last_zoom)) {
+                framebuffer_valid = false; // stale pixels would be scrolled along
+            }
+            scroll_render();
+            for (auto& b : exposed) {
+                render_region(b.a.x, b.a.y, b.b.x, b.b.y);
+            }
+        } else if (far_zoom()) {
+            color_render(canvas.a.x, canvas.a.y, canvas.b.x, canvas.b.y);
+        } else if (!Texture::is_mip(zoom)) {
+            scaled_render(canvas.a.x, canvas.a.y, canvas.b.x, canvas.b.y);
         } else {
             Box canvas(pos, size);
             const Box visible = visible_tiles();
@@ -268,14 +531,294 @@ void Tilemap::draw() {
             Point tile_abs = { mouse_abs.x / (tile_dim.w * zoom), mouse_abs.y / (tile_dim.h * zoom) };
             mouse_abs = { tile_abs.x * (tile_dim.w * zoom), tile_abs.y * (tile_dim.h * zoom) };
             tile_abs = { mouse_abs.x - camera_pos.x + pos.x, mouse_abs.y - camera_pos.y + pos.y };
-            Engine.screen()->blit(t_cursor->pixels(zoom), t_cursor->size(zoom), tile_abs, canvas, t_cursor->transparent());
+            last_cursor = Box(tile_abs, t_cursor->size(zoom));
+            draw_cursor(canvas);
+        } else {
+            last_cursor = Box();
         }
         last_mouse_pos = mpos;
         set_update(false);
+        Engine.screen()->painted(canvas);
+    } else if (!exposed.empty()) {
+        for (auto& b : exposed) {
+            render_region(b.a.x, b.a.y, b.b.x, b.b.y);
+            draw_cursor(b);
+        }
     }
     Composite::draw();
 }
 
+void Tilemap::draw_cursor(Box clip) {
+    Texture* t_cursor = Engine.textures()->get(cursor_texture);
+    if (!t_cursor || last_cursor.a.x == last_cursor.b.x) {
+        return;
+    }
+    if (Texture::is_mip(zoom)) {
+        Engine.screen()->blit(t_cursor->pixels(zoom), t_cursor->size(zoom), last_cursor.a, clip, t_cursor->transparent());
+    } else {
+        float mip = Texture::idx2zoom(Texture::mip_level(zoom));
+        Engine.screen()->blit_scaled(t_cursor->pixels(mip), t_cursor->size(mip), last_cursor.a, t_cursor->size(zoom), clip, t_cursor->transparent());
+    }
+}
+
+
+
+static inline int floor_div(int a, int b) { return a / b - (a % b != 0 && (a < 0) != (b < 0)); }
+
+void Tilemap::scroll_render() {
+    const Box canvas(pos, size);
+    const int dx = camera_pos.x - last_camera_pos.x;
+    const int dy = camera_pos.y - last_camera_pos.y;
+    const bool full_redraw = !framebuffer_valid || zoom != last_zoom || !children.empty() || std::abs(dx) >= size.w || std::abs(dy) >= size.h;
+    last_camera_pos = camera_pos;
+    last_zoom = zoom;
+    framebuffer_valid = true;
+    if (full_redraw) {
+        damaged_tiles.clear();
+        render_region(canvas.a.x, canvas.a.y, canvas.b.x, canvas.b.y);
+        return;
+    }
+
+    // move the pixels of the last frame that stay visible
+    if (dx || dy) {
+        int* pixels = Engine.screen()->pixels;
+        const int stride = Engine.screen()->get_size().w;
+        const int w = size.w - std::abs(dx);
+        const int h = size.h - std::abs(dy);
+        const int dst_x = pos.x + (dx < 0 ? -dx : 0);
+        const int src_x = pos.x + (dx > 0 ? dx : 0);
+        if (dy >= 0) {
+            for (int y = pos.y; y < pos.y + h; y++) {
+                std::memmove(pixels + y * stride + dst_x, pixels + (y + dy) * stride + src_x, w * sizeof(int));
+            }
+        } else {
+            for (int y = pos.y + h - 1; y >= pos.y; y--) {
+                std::memmove(pixels + (y - dy) * stride + dst_x, pixels + y * stride + src_x, w * sizeof(int));
+            }
+        }
+    }
+
+    // newly exposed strips
+    if (dx > 0) render_region(canvas.b.x - dx, canvas.a.y, canvas.b.x, canvas.b.y);
+    else if (dx < 0) render_region(canvas.a.x, canvas.a.y, canvas.a.x - dx, canvas.b.y);
+    if (dy > 0) render_region(canvas.a.x, canvas.b.y - dy, canvas.b.x, canvas.b.y);
+    else if (dy < 0) render_region(canvas.a.x, canvas.a.y, canvas.b.x, canvas.a.y - dy);
+
+    // the cursor of the last frame was scrolled along with the tiles
+    if (last_cursor.a.x != last_cursor.b.x) {
+        render_region(last_cursor.a.x - dx, last_cursor.a.y - dy, last_cursor.b.x - dx, last_cursor.b.y - dy);
+    }
+
+    // edited tiles, including all their wrapped copies
+    const double tile_size_w = tile_dim.w * zoom;
+    const double tile_size_h = tile_dim.h * zoom;
+    const int cam_ref_x = pos.x - camera_pos.x;
+    const int cam_ref_y = pos.y - camera_pos.y;
+    const int pad = Texture::is_mip(zoom) ? 0 : 1; // rounding of the scaled renderer
+    for (auto& tiles : damaged_tiles) {
+        int kx_end = floor_div((camera_pos.x + size.w) / tile_size_w - tiles.a.x, map_size.w) + 1;
+        int ky_end = floor_div((camera_pos.y + size.h) / tile_size_h - tiles.a.y, map_size.h) + 1;
+        for (int ky = floor_div(camera_pos.y / tile_size_h - tiles.b.y, map_size.h); ky <= ky_end; ky++) {
+            for (int kx = floor_div(camera_pos.x / tile_size_w - tiles.b.x, map_size.w); kx <= kx_end; kx++) {
+                render_region(cam_ref_x + (tiles.a.x + kx * map_size.w) * tile_size_w - pad, cam_ref_y + (tiles.a.y + ky * map_size.h) * tile_size_h - pad,
+                              cam_ref_x + (tiles.b.x + kx * map_size.w) * tile_size_w + pad, cam_ref_y + (tiles.b.y + ky * map_size.h) * tile_size_h + pad);
+            }
+        }
+    }
+    damaged_tiles.clear();
+}
+
+void Tilemap::render_region(int x1, int y1, int x2, int y2) {
+    x1 = std::max(x1, (int)pos.x);
+    y1 = std::max(y1, (int)pos.y);
+    x2 = std::min(x2, pos.x + size.w);
+    y2 = std::min(y2, pos.y + size.h);
+    if (x1 >= x2 || y1 >= y2) {
+        return;
+    }
+    if (far_zoom()) {
+        color_render(x1, y1, x2, y2);
+        return;
+    }
+    if (!Texture::is_mip(zoom)) {
+        scaled_render(x1, y1, x2, y2);
+        return;
+    }
+    const int tile_size_w = tile_dim.w * zoom;
+    const int tile_size_h = tile_dim.h * zoom;
+    const int world_x = camera_pos.x - pos.x;
+    const int world_y = camera_pos.y - pos.y;
+    Box tiles(Point(floor_div(world_x + x1, tile_size_w), floor_div(world_y + y1, tile_size_h)),
+              Point(floor_div(world_x + x2 - 1, tile_size_w), floor_div(world_y + y2 - 1, tile_size_h)));
+    unsigned* screen = (unsigned*)Engine.screen()->pixels;
+    const int screen_size_w = Engine.screen()->get_size().w;
+    if (!chunk_cache) {
+        fast_render(tiles, Box(Point(x1, y1), Point(x2, y2)), screen, screen_size_w, pos.x - camera_pos.x, pos.y - camera_pos.y);
+        return;
+    }
+
+    // split the (unwrapped) tile range at chunk borders and copy each visible chunk part
+    struct ChunkBlit {
+        unsigned* pixels;
+        int stride;
+        int x1, y1, x2, y2; // screen area covered by the chunk
+    };
+    std::vector<ChunkBlit> blits;
+    chunk_cache->begin_pass();
+    const int n = chunk_tiles(zoom);
+    for (int ty = tiles.a.y; ty <= tiles.b.y; ) {
+        const int wy = ty - floor_div(ty, map_size.h) * map_size.h;
+        const int cy = wy / n;
+        const int chunk_h = std::min(n, map_size.h - cy * n);
+        const int chunk_y = ty - (wy - cy * n);
+        for (int tx = tiles.a.x; tx <= tiles.b.x; ) {
+            const int wx = tx - floor_div(tx, map_size.w) * map_size.w;
+            const int cx = wx / n;
+            const int chunk_w = std::min(n, map_size.w - cx * n);
+            const int chunk_x = tx - (wx - cx * n);
+            const int sx = chunk_x * tile_size_w - world_x;
+            const int sy = chunk_y * tile_size_h - world_y;
+            blits.push_back({get_chunk(cx, cy, chunk_w, chunk_h), chunk_w * tile_size_w, sx, sy, sx + chunk_w * tile_size_w, sy + chunk_h * tile_size_h});
+            tx = chunk_x + chunk_w;
+        }
+        ty = chunk_y + chunk_h;
+    }
+    parallel_for(y1, y2 - 1, [&](int y) {
+        for (auto& b : blits) {
+            if (y < b.y1 || y >= b.y2) {
+                continue;
+            }
+            const int bx1 = std::max(x1, b.x1);
+            const int bx2 = std::min(x2, b.x2);
+            std::memcpy(screen + y * screen_size_w + bx1, b.pixels + (y - b.y1) * b.stride + (bx1 - b.x1), (bx2 - bx1) * sizeof(unsigned));
+        }
+    });
+}
+
+unsigned* Tilemap::get_chunk(int cx, int cy, int chunk_w, int chunk_h) {
+    const int zoom_level = Texture::zoom2idx(zoom);
+    unsigned* pixels = chunk_cache->get(zoom_level, cx, cy);
+    if (!pixels) {
+        const int n = chunk_tiles(zoom);
+        const int w = chunk_w * tile_dim.w * zoom;
+        const int h = chunk_h * tile_dim.h * zoom;
+        pixels = chunk_cache->add(zoom_level, cx, cy, w * h);
+        Box tiles(Point(cx * n, cy * n), Point(cx * n + chunk_w - 1, cy * n + chunk_h - 1));
+        fast_render(tiles, Box(Point(0, 0), Point(w, h)), pixels, w, -cx * n * (int)(tile_dim.w * zoom), -cy * n * (int)(tile_dim.h * zoom));
+    }
+    return pixels;
+}
+
+
+
+void Tilemap::scaled_render(int x1, int y1, int x2, int y2) {
+    Texture** textures_map = Engine.textures()->id_to_texture;
+    const int zoom_level = Texture::mip_level(zoom);
+    const float mip = Texture::idx2zoom(zoom_level);
+    const int tile_w = tile_dim.w * mip;
+    const int tile_h = tile_dim.h * mip;
+    const long long step = 65536.0 * mip / zoom; // texels of the mip level per screen pixel
+    const int map_size_w = map_size.w;
+    const int map_size_h = map_size.h;
+    const int world_x = camera_pos.x - pos.x;
+    const int world_y = camera_pos.y - pos.y;
+    unsigned* screen = (unsigned*)Engine.screen()->pixels;
+    const int screen_size_w = Engine.screen()->get_size().w;
+    const int chunk_mask = ChunkedMatrix<unsigned>::CHUNK_MASK;
+    const int tx1 = floor_div(((world_x + x1) * step) >> 16, tile_w);
+    const int tx2 = floor_div(((world_x + x2 - 1) * step) >> 16, tile_w);
+    const int ty1 = floor_div(((world_y + y1) * step) >> 16, tile_h);
+    const int ty2 = floor_div(((world_y + y2 - 1) * step) >> 16, tile_h);
+    tiles->load(tx1, ty1, tx2, ty2);
+    root_offsets->load(tx1, ty1, tx2, ty2);
+
+    parallel_for(y1, y2 - 1, [=](int y) {
+        static thread_local std::vector<unsigned> above_row;
+        const int v = ((world_y + y) * step) >> 16;
+        int tile_y = floor_div(v, tile_h);
+        const int texel_y = v - tile_y * tile_h;
+        tile_y -= floor_div(tile_y, map_size_h) * map_size_h;
+        const unsigned* __restrict elems = nullptr;
+        const unsigned short* __restrict offsets = nullptr;
+        int chunk_x = -1; // first tile of the chunk that elems and offsets point into
+        unsigned* __restrict dst = screen + y * screen_size_w;
+
+        long long u = (world_x + x1) * step;
+        for (int x = x1; x < x2; ) {
+            int tile_x = floor_div(u >> 16, tile_w);
+            const long long tile_start = (long long)tile_x * tile_w << 16;
+            const int n = std::min((int)((tile_start + ((long long)tile_w << 16) - u + step - 1) / step), x2 - x);
+            tile_x -= floor_div(tile_x, map_size_w) * map_size_w;
+            if ((tile_x & ~chunk_mask) != chunk_x) {
+                chunk_x = tile_x & ~chunk_mask;
+                elems = tiles->row(chunk_x, tile_y);
+                offsets = root_offsets->row(chunk_x, tile_y);
+            }
+
+            const unsigned current_id = elems[tile_x & chunk_mask];
+            const int ground_id = (short)(current_id & 0xFFFF);
+            const unsigned* ground_pixels = (unsigned*)textures_map[ground_id < 0 ? -ground_id : ground_id]->pixels_at(zoom_level) + texel_y * tile_w;
+            long long texel = u - tile_start;
+            for (int i = 0; i < n; i++, texel += step) {
+                dst[x + i] = ground_pixels[texel >> 16];
+            }
+
+            const int above_id = (short)((current_id & 0xFFFF0000) >> 16);
+            if (above_id) {
+                Texture* above_texture = textures_map[above_id < 0 ? -above_id : above_id];
+                const int above_size_w = above_texture->m_size.w * mip;
+                const unsigned* above_pixels = (unsigned*)above_texture->pixels_at(zoom_level) + texel_y * above_size_w;
+                if (above_id < 0) {
+                    const unsigned offset = offsets[tile_x & chunk_mask];
+                    above_pixels += tile_h * above_size_w * (offset >> 8) + tile_w * (offset & 0xFF);
+                }
+                above_row.resize(n);
+                texel = u - tile_start;
+                for (int i = 0; i < n; i++, texel += step) {
+                    above_row[i] = above_pixels[texel >> 16];
+                }
+                blend_row(dst + x, dst + x, above_row.data(), n);
+            }
+            x += n;
+            u += n * step;
+        }
+    });
+}
+
+
+
+void Tilemap::color_render(int x1, int y1, int x2, int y2) {
+    const long long step_x = 65536.0 / (tile_dim.w * zoom); // tiles per screen pixel
+    const long long step_y = 65536.0 / (tile_dim.h * zoom);
+    const int world_x = camera_pos.x - pos.x;
+    const int world_y = camera_pos.y - pos.y;
+    std::vector<int> columns(x2 - x1);
+    for (int x = x1; x < x2; x++) {
+        int tile_x = ((world_x + x) * step_x) >> 16;
+        columns[x - x1] = tile_x - floor_div(tile_x, map_size.w) * map_size.w;
+    }
+    tile_colors->load(((world_x + x1) * step_x) >> 16, ((world_y + y1) * step_y) >> 16, ((world_x + x2 - 1) * step_x) >> 16, ((world_y + y2 - 1) * step_y) >> 16);
+    unsigned* screen = (unsigned*)Engine.screen()->pixels;
+    const int screen_size_w = Engine.screen()->get_size().w;
+    const int* cols = columns.data();
+    const int chunk_mask = ChunkedMatrix<unsigned>::CHUNK_MASK;
+    parallel_for(y1, y2 - 1, [=](int y) {
+        int tile_y = ((world_y + y) * step_y) >> 16;
+        tile_y -= floor_div(tile_y, map_size.h) * map_size.h;
+        const unsigned* __restrict colors = nullptr;
+        int chunk_x = -1;
+        unsigned* __restrict dst = screen + y * screen_size_w;
+        for (int x = x1; x < x2; x++) {
+            const int tile_x = cols[x - x1];
+            if ((tile_x & ~chunk_mask) != chunk_x) {
+                chunk_x = tile_x & ~chunk_mask;
+                colors = tile_colors->row(chunk_x, tile_y);
+            }
+            dst[x] = colors[tile_x & chunk_mask];
+        }
+    });
+}
+
 
 
 struct CachedTile {
@@ -284,9 +827,7 @@ struct CachedTile {
 };
 constexpr int CACHESIZE = 8;
 
-void Tilemap::fast_render() {
-    const Box canvas(pos, size);
-    const Box visible = visible_tiles();
+void Tilemap::fast_render(const Box& visible, const Box& canvas, unsigned* target, int stride, int origin_x, int origin_y) {
     Texture** textures_map = Engine.textures()->id_to_texture;
     const int zoom_level = Texture::zoom2idx(zoom);
 
@@ -294,9 +835,9 @@ void Tilemap::fast_render() {
     const int tile_size_h = tile_dim.h * zoom;
     const int map_size_w = map_size.w;
     const int map_size_h = map_size.h;
-    const int cam_ref_x = pos.x - camera_pos.x;
-    const int cam_ref_y = pos.y - camera_pos.y;
-    const int screen_size_w = Engine.screen()->get_size().w;
+    const int cam_ref_x = origin_x;
+    const int cam_ref_y = origin_y;
+    const int screen_size_w = stride;
     const int visible_a_x = visible.a.x;
     const int visible_b_x = visible.b.x;
     const int visible_a_y = visible.a.y;
@@ -305,11 +846,12 @@ void Tilemap::fast_render() {
     const int canvas_b_x = canvas.b.x;
     const int canvas_a_y = canvas.a.y;
     const int canvas_b_y = canvas.b.y;
+    const int chunk_mask = ChunkedMatrix<unsigned>::CHUNK_MASK;
+    tiles->load(visible_a_x, visible_a_y, visible_b_x, visible_b_y);
+    root_offsets->load(visible_a_x, visible_a_y, visible_b_x, visible_b_y);
 
     parallel_for(visible_a_y, visible_b_y, [=](int y) {
-        int p_y = y;
-        if (y < 0) p_y += ((-y / map_size_h + 1)) * map_size_h;
-        else if (y >= map_size_h) p_y %= map_size_h;
+        const int p_y = y - floor_div(y, map_size_h) * map_size_h;
         
         int start_y = cam_ref_y + y * tile_size_h;
         int texture_end_y = start_y + tile_size_h;
@@ -318,13 +860,16 @@ void Tilemap::fast_render() {
         if (start_y < canvas_a_y) {
             texture_start_y = (canvas_a_y - start_y);
             start_y = canvas_a_y;
-        } else if (texture_end_y > canvas_b_y) {
+        }
+        if (texture_end_y > canvas_b_y) {
             texture_endcut_y = texture_end_y - canvas_b_y;
         }
         const int upper_bound_y = tile_size_h - texture_start_y - texture_endcut_y;
 
-        const unsigned* __restrict elems = tiles->elems + p_y * map_size_w;     
-        unsigned* __restrict screen = (unsigned*)(Engine.screen()->pixels + start_y * screen_size_w);
+        const unsigned* __restrict elems = nullptr;
+        const unsigned short* __restrict offsets = nullptr;
+        int chunk_x = -1; // first tile of the chunk that elems and offsets point into
+        unsigned* __restrict screen = target + start_y * screen_size_w;
 
         static thread_local CachedTile cached_tiles[CACHESIZE];
         if (y == visible_a_y) {
@@ -338,15 +883,19 @@ void Tilemap::fast_render() {
             if (start_x < canvas_a_x) {
                 texture_start_x = (canvas_a_x - start_x);
                 start_x = canvas_a_x;
-            } else if (texture_end_x > canvas_b_x) {
+            }
+            if (texture_end_x > canvas_b_x) {
                 texture_endcut_x = texture_end_x - canvas_b_x;
             }
             const int upper_bound_x = tile_size_w - texture_start_x - texture_endcut_x;
 
-            int p_x = x;
-            if (x < 0) p_x += ((-x / map_size_w) + 1) * map_size_w;
-            else if (x >= map_size_w) p_x %= map_size_w;
-            const unsigned current_id = elems[p_x];
+            const int p_x = x - floor_div(x, map_size_w) * map_size_w;
+            if ((p_x & ~chunk_mask) != chunk_x) {
+                chunk_x = p_x & ~chunk_mask;
+                elems = tiles->row(chunk_x, p_y);
+                offsets = root_offsets->row(chunk_x, p_y);
+            }
+            const unsigned current_id = elems[p_x & chunk_mask];
             int above_id = (short)((current_id & 0xFFFF0000) >> 16);
             unsigned* __restrict ground_pixels = nullptr;
             int ground_size_w = tile_size_w;
@@ -368,37 +917,20 @@ void Tilemap::fast_render() {
             }
             if (!ground_pixels) {
                 const int ground_id = (short)(current_id & 0xFFFF);
-                ground_pixels = (unsigned*)textures_map[ground_id < 0 ? -ground_id : ground_id]->pixel_map[zoom_level];
+                ground_pixels = (unsigned*)textures_map[ground_id < 0 ? -ground_id : ground_id]->pixels_at(zoom_level);
             }
             unsigned* __restrict texture_pixels = (unsigned*)(ground_pixels + texture_start_y * ground_size_w + texture_start_x); 
 
             if (above_id) {
                 Texture* above_texture = textures_map[above_id < 0 ? -above_id : above_id];
                 const int above_size_w = above_texture->m_size.w * zoom;
-                const int above_size_h = above_texture->m_size.h * zoom;
-                unsigned* __restrict above_pixels = (unsigned*)above_texture->pixel_map[zoom_level] + texture_start_y * above_size_w + texture_start_x;
+                unsigned* __restrict above_pixels = (unsigned*)above_texture->pixels_at(zoom_level) + texture_start_y * above_size_w + texture_start_x;
                 if (above_id < 0) {
-                    for (int y = p_y; y > p_y - above_size_h / tile_size_h; y--) { 
-                        for (int x = p_x; x > p_x - above_size_w / tile_size_w ; x--) {
-                            if (x == p_x && y == p_y) continue;
-                            else if ((short)((tiles->elems[x + map_size_w * y] & 0xFFFF0000) >> 16) == -above_id) {
-                                Point p_root(x, y, map_size);
-                                above_pixels += tile_size_h * above_size_w * (p_y - p_root.y) + tile_size_w * (p_x - p_root.x); 
-                                above_id = 0;
-                                break;
-                            }
-                        }
-                        if (!above_id) break;
-                    }
+                    const unsigned offset = offsets[p_x & chunk_mask];
+                    above_pixels += tile_size_h * above_size_w * (offset >> 8) + tile_size_w * (offset & 0xFF);
                 }
                 for (int y = 0; y < upper_bound_y; y++) {
-                    for (int x = 0; x < upper_bound_x; x++) {
-                        unsigned color1 = texture_pixels[y * tile_size_w + x];
-                        unsigned color2 = above_pixels[y * above_size_w + x];
-                        unsigned rb = (color1 & 0xff00ff) + (((color2 & 0xff00ff) - (color1 & 0xff00ff)) * ((color2 & 0xff000000) >> 24) >> 8);
-                        unsigned g  = (color1 & 0x00ff00) + (((color2 & 0x00ff00) - (color1 & 0x00ff00)) * ((color2 & 0xff000000) >> 24) >> 8);
-                        screen_pixels[y * screen_size_w + x] = (rb & 0xff00ff) | (g & 0x00ff00);
-                    }
+                    blend_row(screen_pixels + y * screen_size_w, texture_pixels + y * tile_size_w, above_pixels + y * above_size_w, upper_bound_x);
                 }
             } else if (upper_bound_x == 2 && upper_bound_y == 2) {
                 *((unsigned long long*)screen_pixels) = *((unsigned long long*)texture_pixels);
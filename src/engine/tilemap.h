@@ -6,46 +6,64 @@
 #include "input.h"
 #include "db.h"
 
+class ChunkCache;
+class MapStream;
+
 class Tilemap : public Composite, Input::Listener {
     public:
         class Listener {
             public:
                 virtual void tile_clicked(Point) {}
                 virtual void map_changed() {}
+                virtual void camera_moved() {}
         };
         
-        Tilemap(Size screen_size): Composite(screen_size) { MAX_NO_UPDATES = 10; }
+        Tilemap(Size screen_size): Composite(screen_size) {}
         void create_map(Size screen_size);
 
         bool set_ground(Texture::ID id, Point p, bool blocked);
         bool set_ground(const std::string& texture_name, Point p, bool blocked);
         bool set_tile(const std::string& texture_name, Point p); 
-        bool set_tile(Texture::ID id, Point p, Size s);
+        // check_ground false places it on blocked ground too, e.g. ground the map generator checked itself
+        bool set_tile(Texture::ID id, Point p, Size s, bool check_ground = true);
         void unset_tile(Point pos);
         Texture::ID get_ground(Point p);
 
         Point texture_root(Point p); 
         Box visible_tiles();
         void randomize_map();
+        // generates the rest of a streamed map right away, e.g. before saving it
+        void finish_map();
 
         void move_cam(Point p);
         void move_cam_to_tile(Point tile_pos);
-        void zoom_cam(int factor);
+        void zoom_cam(float factor);
         void set_cursor_texture(const std::string& name) { cursor_texture = name; }
+        const char* profile_name() { return "Tilemap"; }
 
         Size tilemap_size() { return map_size; }
         Size tile_size() { return tile_dim; }
         float camera_zoom() { return zoom; }
-        void set_zoom(float z) { zoom = z; }
+        void set_zoom(float z) { zoom = z; set_update(true); }
+        // whether the current zoom is drawn from the chunk cache
+        bool chunk_cached() { return chunk_cache && use_fast_renderer && !far_zoom() && Texture::is_mip(zoom); }
+        // the map reports the areas it paints itself, so changes only mark it dirty
+        void set_update(bool update) { dirty = update; }
+        void invalidate() { framebuffer_valid = false; dirty = true; Composite::invalidate(); }
         void add_listener(Tilemap::Listener* l) { click_listeners.push_back(l); }
         void remove_listener(Tilemap::Listener* l) { click_listeners.erase(std::find(click_listeners.begin(), click_listeners.end(), l)); } 
     
     private:
         std::vector<Tilemap::Listener*> click_listeners;
         constexpr static double MAX_ZOOM = 4.0;
-        constexpr static double MIN_ZOOM = 0.125;
+        constexpr static double MIN_ZOOM = 0.03125;
+        constexpr static int FAR_TILE_PIXELS = 2; // tiles this small are drawn in their average color
         bool listener_registered = false;
-        Matrix<unsigned>* tiles = nullptr;
+        // paged in around the camera, map_resident_mb covers the chunks of all three
+        ChunkedMatrix<unsigned>* tiles = nullptr;
+        ChunkedMatrix<unsigned short>* root_offsets = nullptr; // per covered tile: dy << 8 | dx to the root of its object
+        ChunkedMatrix<unsigned>* tile_colors = nullptr; // average color of ground and object per tile
+        int max_chunks = 0;
         Size tile_dim = {0, 0};
         Size map_size = {0, 0};
         struct Camera {
@@ -66,10 +84,44 @@ class Tilemap : public Composite, Input::Listener {
         Point move_vector = {0, 0};
         bool use_fast_renderer = false;
 
+        // state of the previous frame for incremental scrolling
+        constexpr static int MAX_DAMAGED_TILES = 256;
+        bool framebuffer_valid = false;
+        Camera last_camera_pos = {0, 0};
+        float last_zoom = 0;
+        Box last_cursor;
+        Camera listener_camera_pos = {0, 0};
+        float listener_zoom = 0;
+        std::vector<Box> damaged_tiles;
+        bool generating = false;
+
+        // with stream_mapgen, chunks are generated in the background and applied while drawing
+        constexpr static int STREAM_LOOKAHEAD = 30; // frames of camera movement generated ahead
+        MapStream* map_stream = nullptr;
+        Camera stream_camera = {0, 0};
+
+        // pre-composited blocks of tiles, only used by the fast renderer at mip zoom levels, tiles of at
+        // most FAR_TILE_PIXELS are drawn from tile_colors instead, which is cheaper than any cached chunk
+        constexpr static int CHUNK_PIXELS = 512;
+        ChunkCache* chunk_cache = nullptr;
+
         void mouse_clicked(Point p);
+        void stream_map();
+        void build_root_offsets();
+        void update_tile_colors(Point p, Size s);
+        bool far_zoom() { return tile_dim.w * zoom <= FAR_TILE_PIXELS; }
         void fix_camera();
+        void focus_camera();
         void draw();
-        void fast_render();
+        void draw_cursor(Box clip);
+        void damage_tiles(Point p, Size s);
+        void scroll_render();
+        void render_region(int x1, int y1, int x2, int y2);
+        int chunk_tiles(float z) { return std::max(4, CHUNK_PIXELS / std::max(1, (int)(tile_dim.w * z))); }
+        unsigned* get_chunk(int cx, int cy, int chunk_w, int chunk_h);
+        void scaled_render(int x1, int y1, int x2, int y2);
+        void color_render(int x1, int y1, int x2, int y2);
+        void fast_render(const Box& tiles, const Box& clip, unsigned* target, int stride, int origin_x, int origin_y);
 };
 
 #endif
@@ -50,6 +50,9 @@ void Screen::init_script_api() {
     Engine.register_script_function({"UI_new_button", {ScriptType::NUMBER, ScriptType::NUMBER, ScriptType::STRING, ScriptType::CALLBACK}, [&](const std::vector<ScriptParam>& params) {
         return new ScriptingButton({params[0].d(), params[1].d()}, params[2].s(), params[3].cb());
     }});
+    Engine.register_script_function({"UI_container_layered", {ScriptType::HANDLE, ScriptType::NUMBER}, [&](const std::vector<ScriptParam>& params) {
+        params[0].p<Composite>()->set_layered(params[1].i()); return 0;
+    }});
     Engine.register_script_function({"UI_container_dispose", {ScriptType::HANDLE}, [&](const std::vector<ScriptParam>& params) {
         delete params[0].p<Composite>(); return 0;
     }});
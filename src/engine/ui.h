@@ -21,6 +21,7 @@ class ProgressBar : public Composite {
                     pixels[y * size.w + x] = x <= cutoff ? color_fg : color_bg;
                 }
             }
+            set_update(true);
         }
 
         Color color_fg;
@@ -36,7 +37,8 @@ class Text : public Composite {
         void set_text(const std::string& txt, short txt_height) {
             lines.clear();
             lines.resize(1);
-            std::vector<Texture*> word;
+            height = txt_height;
+            std::string word;
             int current_line = 0;
             short word_length = 0;
             short line_length = 0;
@@ -48,7 +50,7 @@ class Text : public Composite {
                 if (newline) {
                     total_height += line_height;
                     lines[current_line].insert(lines[current_line].end(), word.begin(), word.end());
-                    lines.push_back(std::vector<Texture*>());
+                    lines.push_back(std::string());
                     line_length = 0;
                     line_height = 0;
                     current_line++;
@@ -56,11 +58,11 @@ class Text : public Composite {
                     word_length = 0;
                     continue;
                 }
-                Texture* t = Engine.textures()->get(txt[i], txt_height);
-                if (t) {
-                    word.push_back(t);
-                    word_length += t->size().w;
-                    line_height = t->size().h > line_height ? t->size().h : line_height;
+                const Box* glyph = Engine.textures()->glyph(txt[i], txt_height);
+                if (glyph) {
+                    word.push_back(txt[i]);
+                    word_length += glyph->b.x - glyph->a.x;
+                    line_height = glyph->b.y - glyph->a.y > line_height ? glyph->b.y - glyph->a.y : line_height;
                 }
                 if (txt[i] == ' ' || i == (int)(txt.size()-1)) {
                     if (line_length + word_length < size.w) {
@@ -82,6 +84,7 @@ class Text : public Composite {
                     word_length = 0;
                 }
             }
+            set_update(true);
         }
 
         void draw() {
@@ -89,29 +92,31 @@ class Text : public Composite {
                 init();
                 initialized = true;
             }
-            if (needs_update()) {
+            // letters are blended, so only the repainted parts below may be drawn again
+            const std::vector<Box> boxes = repaint_boxes();
+            for (auto& clip : boxes) {
                 if (m_texture) {
-                    Engine.screen()->blit(m_texture->pixels(1.0), m_texture->size(1.0), pos, Box(pos, size), false);
+                    Engine.screen()->blit(m_texture->pixels(1.0), m_texture->size(1.0), pos, clip, false);
                 }
                 Point p = pos;
                 for (auto& line : lines) {
-                    short line_height = 0;
-                    for (auto& letter : line) {
-                        Engine.screen()->blit(letter->pixels(1.0), letter->size(1.0), p, Box(pos, size), true);
-                        p.x += letter->size().w;
-                        line_height = letter->size().h > line_height ? letter->size().h : line_height;
+                    Texture* t = Engine.textures()->get_text(line, height);
+                    if (t) {
+                        Engine.screen()->blit(t->pixels(1.0), t->size(1.0), p, clip, true);
+                        p.y += t->size().h;
                     }
-                    p.x = pos.x;
-                    p.y += line_height;
                 }
+            }
+            if (!boxes.empty()) {
                 set_update(false);
             }
             for (auto& child : children) {
-                child->draw();
+                child->render();
             }
         }
 
-        std::vector<std::vector<Texture*>> lines;
+        std::vector<std::string> lines;
+        short height = 0;
 };
 
 class TextInput : public Text, public Input::Listener {
@@ -156,6 +161,7 @@ class Button : public Composite, public Input::Listener {
         void set_texture(Texture* t) {
             m_texture = t; 
             size = t->size();
+            set_update(true);
         }
 
         void set_text(const std::string& s) { text_composite->set_text(s, size.h * 0.5); }
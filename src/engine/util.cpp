@@ -17,13 +17,24 @@ std::pair<Color*, Size> load_bmp(const std::string& filepath) {
 #include "extern/stb_truetype.h"
 #include <stdio.h>
 std::vector<std::pair<Color*, Size>> load_letters(const std::string& fontpath, int height, Color color, char start, char end) {
-    static unsigned char ttf_buffer[1<<25];
+    // the parsed font stays loaded for the next height
+    static std::vector<unsigned char> ttf_buffer;
+    static std::string ttf_path;
+    static stbtt_fontinfo font;
     std::vector<std::pair<Color*, Size>> ret;
-    FILE* fontfile = fopen(fontpath.c_str(), "rb");
-    fread(ttf_buffer, 1, 1<<25, fontfile);
-    fclose(fontfile);
-    stbtt_fontinfo font;
-    stbtt_InitFont(&font, ttf_buffer, stbtt_GetFontOffsetForIndex(ttf_buffer,0));
+    if (fontpath != ttf_path) {
+        FILE* fontfile = fopen(fontpath.c_str(), "rb");
+        if (!fontfile) {
+            return ret;
+        }
+        fseek(fontfile, 0, SEEK_END);
+        ttf_buffer.resize(ftell(fontfile));
+        fseek(fontfile, 0, SEEK_SET);
+        fread(ttf_buffer.data(), 1, ttf_buffer.size(), fontfile);
+        fclose(fontfile);
+        stbtt_InitFont(&font, ttf_buffer.data(), stbtt_GetFontOffsetForIndex(ttf_buffer.data(), 0));
+        ttf_path = fontpath;
+    }
     float scale = stbtt_ScaleForPixelHeight(&font, (float)height);
     int ascent, descent, lineGap;
     stbtt_GetFontVMetrics(&font, &ascent, &descent, &lineGap);  
@@ -64,6 +75,8 @@ FileHandle file_open(const std::string& path) {
     return (FileHandle)fopen(path.c_str(), "rb+");
 }
 
+FileHandle file_temp() { return (FileHandle)tmpfile(); }
+
 void file_close(FileHandle file) { fclose((FILE*)file); }
 
 void file_read(FileHandle file, char* buffer, int num_bytes) { fread(buffer, num_bytes, 1, (FILE*)file); }
@@ -84,6 +97,14 @@ void file_writeline(FileHandle file, const std::string& s) {
 
 bool file_isend(FileHandle file) { return feof((FILE*)file); }
 
+void file_seek(FileHandle file, long long offset) {
+#ifdef _WIN32
+    _fseeki64((FILE*)file, offset, SEEK_SET);
+#else
+    fseeko((FILE*)file, offset, SEEK_SET);
+#endif
+}
+
 bool file_exists(const std::string& path) {
     FILE* file = fopen(path.c_str(), "r");
     if (file) {
@@ -162,8 +183,17 @@ void print(const std::string& s) { puts(s.c_str()); }
 
 
 static SDL_Window* window = nullptr;
-
-Color* create_window(Size s, bool fullscreen) {
+static Color* framebuffer = nullptr;
+
+Color* create_window(Size s, bool fullscreen, bool headless) {
+    if (headless) {
+        if (!framebuffer) {
+            // no video or audio device, events and timers still go through SDL
+            SDL_Init(SDL_INIT_EVENTS | SDL_INIT_TIMER);
+            framebuffer = new Color[s.w * s.h];
+        }
+        return framebuffer;
+    }
     if (!window) {
 #ifdef _WIN32
         SDL_setenv("SDL_AUDIODRIVER", "directsound", true); 
@@ -188,40 +218,75 @@ void update_window() {
 
 #include <chrono>
 #include <random>
+#include <thread>
 void wait(int us) {
-    SDL_Delay(us / 1000);
+    // sleeping may overshoot by a scheduler tick, which would miss the frame deadline, so the
+    // thread sleeps until 1 ms before it and only yields for the rest
+    using clock = std::chrono::steady_clock;
+    const clock::time_point deadline = clock::now() + std::chrono::microseconds(us);
+    if (us > 1000) {
+        std::this_thread::sleep_until(deadline - std::chrono::milliseconds(1));
+    }
+    while (clock::now() < deadline) {
+        std::this_thread::yield();
+    }
+}
+
+bool wait_events(int us) {
+    // leaves the event in the queue for pressed_keys()
+    return SDL_WaitEventTimeout(nullptr, std::max(1, us / 1000)) == 1;
 }
 
 long long now() {
     return std::chrono::time_point_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now()).time_since_epoch().count();
 }
 
+static unsigned current_seed = (unsigned)now();
+static unsigned long long fast_state = 0;
+static std::default_random_engine uniform_generator;
+static std::default_random_engine gauss_generator;
+
+void set_random_seed(unsigned seed) {
+    current_seed = seed;
+    auto generator = std::default_random_engine(seed);
+    std::uniform_int_distribution<int> distribution(0, 2147483647);
+    fast_state = distribution(generator);
+    uniform_generator.seed(seed);
+    gauss_generator.seed(seed);
+}
+
+unsigned random_seed() { return current_seed; }
+
 double random_fast() {
-    static unsigned long long r = 0;
     static bool init = false;
     if (!init) {
-        unsigned seed = (unsigned)now();
-        auto generator = std::default_random_engine(seed);
-        std::uniform_int_distribution<int> distribution(0, 2147483647);
-        r = distribution(generator);
+        set_random_seed(current_seed);
         init = true;
     }
-    r = (r * 48271) % 2147483648;
-    return (double)r / 2147483648;
+    fast_state = (fast_state * 48271) % 2147483648;
+    return (double)fast_state / 2147483648;
+}
+
+double random_hash(unsigned salt, int x, int y) {
+    unsigned long long h = ((unsigned long long)salt << 32) ^ ((unsigned long long)(unsigned)y << 16) ^ (unsigned)x;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (double)(h >> 11) / (double)(1ULL << 53);
 }
 
 double random_uniform(double min, double max) {
-    static unsigned seed = (unsigned)now();
-    static std::default_random_engine generator(seed);
+    random_fast(); // seeds the generators on first use
     std::uniform_real_distribution<double> distribution(min, max);
-    return distribution(generator);
+    return distribution(uniform_generator);
 }
 
 double random_gauss(double mean, double dev) {
-    static unsigned seed = (unsigned)now();
-    static std::default_random_engine generator(seed);
+    random_fast();
     std::normal_distribution<double> distribution(mean, dev);
-    return distribution(generator);
+    return distribution(gauss_generator);
 }
 
 
@@ -339,7 +404,7 @@ Point mouse_pos() {
 #define SDEFL_IMPLEMENTATION
 #include "extern/sdefl.h"
 #include "extern/sinfl.h"
-static struct sdefl sdefl;
+static thread_local struct sdefl sdefl; // compress() runs in parallel jobs
 
 void compress(void* in_data, int in_len, void* out_data, int& out_len) {
     out_len = sdeflate(&sdefl, out_data, in_data, in_len, 1);
@@ -349,83 +414,315 @@ void decompress(void* in_data, int in_len, void* out_data, int out_len) {
     sinflate(out_data, out_len, in_data, in_len);
 }
 
+static unsigned crc32(const unsigned char* data, int len) {
+    static unsigned table[256];
+    if (!table[1]) {
+        for (unsigned n = 0; n < 256; n++) {
+            unsigned c = n;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+    }
+    unsigned crc = 0xFFFFFFFF;
+    for (int i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void put_u32(std::vector<unsigned char>& out, unsigned u) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back((u >> shift) & 0xFF);
+    }
+}
+
+bool write_image(const std::string& path, const Color* pixels, Size size, int stride) {
+    const bool png = path.size() >= 4 && path.compare(path.size() - 4, 4, ".png") == 0;
+    std::vector<unsigned char> rgb;
+    rgb.reserve((3 * size.w + 1) * size.h);
+    for (int y = 0; y < size.h; y++) {
+        if (png) {
+            rgb.push_back(0); // no row filter
+        }
+        for (int x = 0; x < size.w; x++) {
+            const Color& c = pixels[y * stride + x];
+            rgb.push_back(c.red);
+            rgb.push_back(c.green);
+            rgb.push_back(c.blue);
+        }
+    }
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    if (!png) {
+        fprintf(file, "P6\n%d %d\n255\n", size.w, size.h);
+        fwrite(rgb.data(), 1, rgb.size(), file);
+        fclose(file);
+        return true;
+    }
+    auto write_chunk = [&](const char* type, const std::vector<unsigned char>& data) {
+        std::vector<unsigned char> chunk;
+        put_u32(chunk, data.size());
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+        put_u32(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+        fwrite(chunk.data(), 1, chunk.size(), file);
+    };
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, file);
+    std::vector<unsigned char> header;
+    put_u32(header, size.w);
+    put_u32(header, size.h);
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // 8 bit rgb, not interlaced
+    write_chunk("IHDR", header);
+    std::vector<unsigned char> data(sdefl_bound(rgb.size()) + 6);
+    data.resize(zsdeflate(&sdefl, data.data(), rgb.data(), rgb.size(), 1));
+    write_chunk("IDAT", data);
+    write_chunk("IEND", {});
+    fclose(file);
+    return true;
+}
+
 
 
 
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <memory>
+
+struct Job {
+    std::function<void()> f;
+    std::atomic<int> pending{1}; // unfinished dependencies, plus one until the job is submitted
+    std::atomic<bool> done{false};
+    bool background = false;
+    std::mutex mutex;
+    std::vector<JobHandle> continuations;
+};
 
-class ThreadPool {
+// Work stealing scheduler: every worker pops its newest jobs from the back of its own deque,
+// idle workers steal the oldest jobs from the front of the others. Threads outside of the
+// pool share deque 0. Waiting threads run other jobs meanwhile, so jobs can wait on jobs.
+// Background jobs wait in a queue of their own that only idle workers take from.
+class JobSystem {
     public:
-    ThreadPool(int threads = 4) {
-        for (int i = 0; i < threads; ++i) {
-            m_threads.emplace_back(std::thread([this]() {
-                while (true) {
-                    std::unique_lock<std::mutex> latch(m_queue_mutex);
-                    cv_task.wait(latch, [this](){ return stop || !m_workQueue.empty(); });
-                    if (!m_workQueue.empty()) {
-                        ++busy;
-                        auto fn = m_workQueue.front();
-                        m_workQueue.erase(m_workQueue.begin());
-                        latch.unlock();
-                        fn();
-                        latch.lock();
-                        --busy;
-                        cv_finished.notify_one();
-                    } else if (stop) {
-                        break;
+    JobSystem() {
+        // ENGINE_THREADS=n overrides the number of threads, including the calling thread
+        const char* forced = getenv("ENGINE_THREADS");
+        const int threads = std::max(2, forced ? atoi(forced) : (int)std::thread::hardware_concurrency());
+        for (int i = 0; i < threads; i++) {
+            queues.emplace_back(new Queue());
+        }
+        for (int i = 1; i < threads; i++) {
+            workers.emplace_back([this, i]() {
+                worker_index = i;
+                while (!stop) {
+                    if (run_one() || run_background()) {
+                        continue;
                     }
+                    std::unique_lock<std::mutex> lock(sleep_mutex);
+                    cv_work.wait(lock, [this]() { return stop || queued > 0; });
                 }
-            }));
+            });
         }
     }
 
-    ~ThreadPool() {
-        std::unique_lock<std::mutex> latch(m_queue_mutex);
-        stop = true;
-        cv_task.notify_all();
-        latch.unlock();
-        for (auto& t : m_threads) {
+    ~JobSystem() {
+        {
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            stop = true;
+        }
+        cv_work.notify_all();
+        for (auto& t : workers) {
             t.join();
         }
     }
 
-    template<typename F>
-    void add(F&& f) {
-        std::unique_lock<std::mutex> lock(m_queue_mutex);
-        m_workQueue.emplace_back(std::forward<F>(f));
-        cv_task.notify_one();
+    int size() { return queues.size(); }
+
+    void push(const JobHandle& job) {
+        Queue& q = job->background ? background : *queues[worker_index];
+        {
+            std::unique_lock<std::mutex> lock(q.mutex);
+            q.jobs.push_back(job);
+        }
+        {
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            queued++;
+        }
+        cv_work.notify_one();
+    }
+
+    bool run_one() {
+        JobHandle job = take();
+        if (!job) {
+            return false;
+        }
+        run(job);
+        return true;
     }
 
-    void wait() {
-        std::unique_lock<std::mutex> lock(m_queue_mutex);
-        cv_finished.wait(lock, [this](){ return m_workQueue.empty() && (busy == 0); });
+    bool run_background() {
+        JobHandle job;
+        {
+            std::unique_lock<std::mutex> lock(background.mutex);
+            if (background.jobs.empty()) {
+                return false;
+            }
+            job = background.jobs.front();
+            background.jobs.pop_front();
+        }
+        queued--;
+        run(job);
+        return true;
+    }
+
+    // runs the background job on the calling thread if no worker started it yet
+    bool run_background(const JobHandle& job) {
+        {
+            std::unique_lock<std::mutex> lock(background.mutex);
+            auto it = std::find(background.jobs.begin(), background.jobs.end(), job);
+            if (it == background.jobs.end()) {
+                return false;
+            }
+            background.jobs.erase(it);
+        }
+        queued--;
+        run(job);
+        return true;
+    }
+
+    private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<JobHandle> jobs;
+    };
+    std::vector<std::unique_ptr<Queue>> queues;
+    Queue background;
+    std::vector<std::thread> workers;
+    std::mutex sleep_mutex;
+    std::condition_variable cv_work;
+    std::atomic<int> queued{0};
+    std::atomic<bool> stop{false};
+    static thread_local int worker_index;
+
+    void run(const JobHandle& job) {
+        job->f();
+        job->f = nullptr;
+        std::vector<JobHandle> continuations;
+        {
+            std::unique_lock<std::mutex> lock(job->mutex);
+            job->done = true;
+            continuations.swap(job->continuations);
+        }
+        for (auto& c : continuations) {
+            if (--c->pending == 0) {
+                push(c);
+            }
+        }
     }
 
-private:
-    std::vector<std::thread> m_threads;
-    std::vector<std::function<void(void)>> m_workQueue;
-    std::mutex m_queue_mutex;
-    std::condition_variable cv_task;
-    std::condition_variable cv_finished;
-    unsigned busy = 0;
-    bool stop = false;
+    JobHandle take() {
+        const int n = queues.size();
+        JobHandle job;
+        for (int i = 0; i < n && !job; i++) {
+            Queue& q = *queues[(worker_index + i) % n];
+            std::unique_lock<std::mutex> lock(q.mutex);
+            if (q.jobs.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                job = q.jobs.back();
+                q.jobs.pop_back();
+            } else {
+                job = q.jobs.front();
+                q.jobs.pop_front();
+            }
+        }
+        if (job) {
+            queued--;
+        }
+        return job;
+    }
 };
 
-static ThreadPool pool;
-constexpr static int num_threads = 4;
+thread_local int JobSystem::worker_index = 0;
+static JobSystem jobs;
+
+JobHandle run_job(const std::function<void()>& f, const std::vector<JobHandle>& dependencies) {
+    JobHandle job = std::make_shared<Job>();
+    job->f = f;
+    job->pending = 1 + dependencies.size();
+    int finished = 1;
+    for (auto& dependency : dependencies) {
+        std::unique_lock<std::mutex> lock(dependency->mutex);
+        if (dependency->done) {
+            finished++;
+        } else {
+            dependency->continuations.push_back(job);
+        }
+    }
+    if (job->pending.fetch_sub(finished) == finished) {
+        jobs.push(job);
+    }
+    return job;
+}
 
-void parallel_for(int begin, int end, const std::function<void(int)>& f) {
-    int block_size = (end - begin) / num_threads;
-    int block_begin = begin;
-    int block_end = begin + block_size - 1;
-    for (int t = 0; t < num_threads; t++) {
-        pool.add([=](){ for (int i = block_begin; i <= block_end; i++) f(i);});
-        block_begin += block_size;
-        block_end = t == num_threads - 2 ? end : block_end + block_size; 
+JobHandle run_background_job(const std::function<void()>& f) {
+    JobHandle job = std::make_shared<Job>();
+    job->f = f;
+    job->background = true;
+    job->pending = 0;
+    jobs.push(job);
+    return job;
+}
+
+void wait_job(const JobHandle& job) {
+    while (!job->done) {
+        if (job->background && jobs.run_background(job)) {
+            continue;
+        }
+        if (!jobs.run_one()) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool job_done(const JobHandle& job) { return job->done; }
+
+int num_workers() { return jobs.size(); }
+
+void parallel_for(int begin, int end, const std::function<void(int)>& f, int grain) {
+    const int n = end - begin + 1;
+    if (n <= 0) {
+        return;
+    }
+    if (grain <= 0) {
+        grain = std::max(1, n / (8 * jobs.size()));
+    }
+    const int num_chunks = (n + grain - 1) / grain;
+    // chunks are handed out one by one, so rows with more work do not hold up a whole block
+    std::atomic<int> next_chunk{0};
+    auto run_chunks = [&]() {
+        for (int c = next_chunk++; c < num_chunks; c = next_chunk++) {
+            const int chunk_end = std::min(end, begin + (c + 1) * grain - 1);
+            for (int i = begin + c * grain; i <= chunk_end; i++) {
+                f(i);
+            }
+        }
+    };
+    std::vector<JobHandle> helpers;
+    for (int i = 1; i < std::min(num_chunks, jobs.size()); i++) {
+        helpers.push_back(run_job(run_chunks));
+    }
+    run_chunks();
+    for (auto& helper : helpers) {
+        wait_job(helper);
     }
-    pool.wait();
 }
 
 
@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <map>
 #include <functional>
+#include <memory>
 
 // Utility data structures
 
@@ -90,7 +91,7 @@ template<int N> struct String {
     String<N>& operator=(const String<N>& c) { memcpy(mem, c.mem, N); return *this;}
     String<N>& operator=(const std::string& c) { strncpy(mem, c.c_str(), c.size()); return *this;}
     //String<N>& operator=(const char* c) { strcpy(mem, c); return *this;}
-    std::string toStdString() { return std::string(mem); }
+    std::string toStdString() const { return std::string(mem); }
     char mem[N] = {0};
 };
 using String8 = String<8>;
@@ -108,12 +109,14 @@ std::vector<std::pair<Color*, Size>> load_letters(const std::string& fontpath, i
 
 using FileHandle = void*;
 FileHandle file_open(const std::string& path);
+FileHandle file_temp(); // removed once it is closed or the program ends
 void file_close(FileHandle file);
 void file_read(FileHandle file, char* buffer, int num_bytes);
 void file_write(FileHandle file, char* buffer, int num_bytes);
 std::string file_readline(FileHandle file);
 void file_writeline(FileHandle file, const std::string& s);
 bool file_isend(FileHandle file);
+void file_seek(FileHandle file, long long offset);
 bool file_exists(const std::string& path);
 
 std::vector<std::string> filelist(const std::string& path, const std::string& filter = "");
@@ -123,13 +126,20 @@ void replace(std::string& s, const std::string& from, const std::string& to);
 double to_double(const std::string& s);
 void print(const std::string& s);
 
-Color* create_window(Size s, bool fullscreen);
+// headless renders into a heap framebuffer without opening a window
+Color* create_window(Size s, bool fullscreen, bool headless = false);
 void update_window();
 
 void wait(int us);
+bool wait_events(int us); // blocks until an input event is queued or the timeout has passed
 long long now();
 
+// all generators restart from the seed, e.g. to replay a recorded session
+void set_random_seed(unsigned seed);
+unsigned random_seed();
 double random_fast();
+// stateless and thread safe, the same salt and position give the same value in [0, 1)
+double random_hash(unsigned salt, int x, int y);
 double random_uniform(double min, double max);
 double random_gauss(double mean, double dev);
 
@@ -142,8 +152,26 @@ Point mouse_pos();
 
 void compress(void* in_data, int in_len, void* out_data, int& out_len);
 void decompress(void* in_data, int in_len, void* out_data, int out_len);
+// 8 bit rgb, png if the path ends with .png and binary ppm otherwise
+bool write_image(const std::string& path, const Color* pixels, Size size, int stride);
 
-void parallel_for(int begin, int end, const std::function<void(int)>& f);
+struct Job;
+// finished once the function ran, jobs can be waited on or passed as dependencies of other jobs
+using JobHandle = std::shared_ptr<Job>;
+JobHandle run_job(const std::function<void()>& f, const std::vector<JobHandle>& dependencies = {});
+// for work that may take longer than a frame, e.g. map generation or compression, workers only
+// pick it up when no other jobs are queued and waiting threads never run it for other jobs
+JobHandle run_background_job(const std::function<void()>& f);
+// runs other jobs until the job is finished, so it can be called from inside jobs
+void wait_job(const JobHandle& job);
+bool job_done(const JobHandle& job);
+int num_workers();
+// calls f for begin to end inclusive, in chunks of grain indices, 0 picks a grain for the number of workers
+void parallel_for(int begin, int end, const std::function<void(int)>& f, int grain = 0);
+
+void blend_row(unsigned* dst, const unsigned* below, const unsigned* above, int n);
+void blend_color_row(unsigned* dst, unsigned color, int n); // blend_row with the same color above every pixel
+std::string simd_level();
 
 
 
@@ -178,6 +206,7 @@ struct ScriptParam {
     auto end() const { return std::get<2>(val).end(); }
     const ScriptParam& operator[](const std::string& key) const { return std::get<2>(val).find(key)->second; }
     bool contains(const std::string& s) const { return std::get<2>(val).find(s) != end(); }
+    void set(const std::string& key, const ScriptParam& value) { std::get<2>(val)[key] = value; }
     ScriptType type() const {
         if (std::holds_alternative<double>(val)) return ScriptType::NUMBER;
         else if (std::holds_alternative<std::string>(val)) return ScriptType::STRING;
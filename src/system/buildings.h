@@ -11,6 +11,9 @@
 class Buildings {
     public:
         constexpr static int MAX_BUILDINGS_PER_TOWN = 64;
+
+        // a property column, resolved once by name and then accessed without a lookup
+        using Property = Table<double>*;
         
         struct Type {
             Type(): name(""), price(0) {}
@@ -18,6 +21,7 @@ class Buildings {
             std::string name;
             int price;
             std::map<std::string, double> properties;
+            std::vector<std::pair<Property, double>> columns;
         };
 
         struct Building {
@@ -42,14 +46,18 @@ class Buildings {
         };
     
         Buildings() {
+            towns = Engine.db()->get_table<Town>("towns");
+            buildings = Engine.db()->get_table<Building>("buildings", KeyIndex::HASH);
             for (auto& p : Engine.config("buildings")["buildings"]) {
                 auto& t = p.second;
-                m_types[t["name"].s()] = Type(t["name"].s(), t["price"].i());
+                Type& type = m_types[t["name"].s()] = Type(t["name"].s(), t["price"].i());
                 for (auto& p : t["properties"]) {
-                    m_types[t["name"].s()].properties[p.first.s()] = p.second.d(); 
+                    type.properties[p.first.s()] = p.second.d(); 
+                    type.columns.push_back({property(p.first.s()), p.second.d()});
                 }
             }
             max_town_distance = Engine.config("buildings")["max_town_distance"].i();
+            towns->set_spatial_index(max_town_distance);
         }
 
         virtual ~Buildings() {}
@@ -62,49 +70,56 @@ class Buildings {
             return ret;
         }
 
-        bool has_property(Point building, const std::string& property) {
-            return Engine.db()->get_table<double>(property)->exists(building);
+        Property property(const std::string& name) {
+            return Engine.db()->get_table<double>(name, KeyIndex::HASH);
+        }
+
+        bool has_property(Point building, Property column) {
+            return column->exists(building);
         }
 
-        double get_property(Point building, const std::string& property) {
-            if (has_property(building, property)) {
-                return Engine.db()->get_table<double>(property)->get(building);
+        double get_property(Point building, Property column) {
+            if (has_property(building, column)) {
+                return column->read(building);
             }
             return 0.0;
         }
 
-        void set_property(Point building, const std::string& property, double value) {
-            if (has_property(building, property)) {
-                Engine.db()->get_table<double>(property)->add(building);
+        void set_property(Point building, Property column, double value) {
+            if (!has_property(building, column)) {
+                column->add(building);
             }
-            Engine.db()->get_table<double>(property)->get(building) = value;
+            column->get(building) = value;
         }
 
+        // by name, for scripts
+        bool has_property(Point building, const std::string& name) { return has_property(building, property(name)); }
+        double get_property(Point building, const std::string& name) { return get_property(building, property(name)); }
+        void set_property(Point building, const std::string& name, double value) { set_property(building, property(name), value); }
+
         void destroy(Point p) {
             p = Engine.map()->texture_root(p);
-            auto table = Engine.db()->get_table<Town>("towns");
-            if (table->exists(p)) {
-                Town& town = table->get(p);
+            if (towns->exists(p)) {
+                Town& town = towns->get(p);
                 for (auto& b : town.buildings) {
                     if (b.x < 0 || b.y < 0 || b == p) break;
                     destroy(b);
                 }
-                table->erase(p);
+                towns->erase(p);
             }
             Engine.map()->unset_tile(p);
         }
 
         void set_townname(Point p, const std::string& name) {
-            auto table = Engine.db()->get_table<Town>("towns");
-            if (table->exists(p)) {
-                table->get(p).name = name;
+            if (towns->exists(p)) {
+                towns->get(p).name = name;
             }
         }
 
         std::vector<std::pair<std::string, Point>> townlist() {
             std::vector<std::pair<std::string, Point>> ret;
-            auto table = Engine.db()->get_table<Town>("towns");
-            for (auto it = table->begin(); it != table->end(); ++it) {
+            auto rows = towns->read_rows();
+            for (auto it = rows.begin(); it != rows.end(); ++it) {
                 ret.push_back({(*it).name.toStdString(), it.key()});
             }
             return ret;
@@ -112,7 +127,7 @@ class Buildings {
 
         std::vector<Point> buildinglist(Point town) {
             std::vector<Point> ret;
-            auto& t = Engine.db()->get_table<Town>("towns")->get(town);
+            auto& t = towns->read(town);
             for (auto b : t.buildings) {
                 if (b.x < 0 || b.y < 0) break;
                 ret.push_back(b);
@@ -121,31 +136,20 @@ class Buildings {
         }
 
         bool create_town(Point p) {
-            auto table = Engine.db()->get_table<Town>("towns");
-            for (auto it = table->begin(); it != table->end(); ++it) {
-                Point pos(it.key());
-                if (pos.distance(p) < 2 * max_town_distance) {
-                    return false;
-                }
+            if (!towns->within(p, 2 * max_town_distance - 1).empty()) {
+                return false;
             }
-            table->add(p);
+            towns->add(p);
             return true;
         }
 
         bool create(const std::string& name, Point p) {
-            auto table = Engine.db()->get_table<Town>("towns");
-            bool town_found = false;
-            for (auto it = table->begin(); it != table->end(); ++it) {
-                Point pos(it.key());
-                if (pos.distance(p) < max_town_distance) {
-                    (*it).add_building(p);
-                    town_found = true;
-                    break;
-                }
-            }
-            if (!town_found) {
+            auto near = towns->within(p, max_town_distance - 1);
+            if (near.empty()) {
                 return false;
             }
+            // the town with the lowest key, like the first one in the sorted table
+            towns->get(*std::min_element(near.begin(), near.end())).add_building(p);
 
             int price = m_types[name].price;
             if (!System.player()->change_cash(-price)) {
@@ -154,9 +158,9 @@ class Buildings {
             }
 
             if (Engine.map()->set_tile(name, p)) {
-                Engine.db()->get_table<Building>("buildings")->add(p);
-                for (auto& param : m_types[name].properties) {
-                    Engine.db()->get_table<double>(param.first)->add(p) = param.second;
+                buildings->add(p);
+                for (auto& column : m_types[name].columns) {
+                    column.first->add(p) = column.second;
                 }
                 return true;
             }
@@ -167,6 +171,8 @@ class Buildings {
     private:
         std::map<std::string, Buildings::Type> m_types;
         int max_town_distance;
+        Table<Town>* towns;
+        Table<Building>* buildings;
 };
 
 #endif
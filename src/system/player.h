@@ -12,7 +12,7 @@ class Player {
 
     public:
     Player() {
-        auto table = Engine.db()->get_table<Entity>("player");
+        table = Engine.db()->get_table<Entity>("player", KeyIndex::HASH);
         int startmoney = Engine.config("buildings")["startmoney"].i();
         if (!table->exists(0)) {
             table->add(0);
@@ -21,15 +21,15 @@ class Player {
     }
 
     std::string worldname() {
-        return Engine.db()->get_table<Entity>("player")->get(0).worldname.toStdString();
+        return table->read(0).worldname.toStdString();
     }
 
     void set_worldname(const std::string& name) {
-        Engine.db()->get_table<Entity>("player")->get(0).worldname = name;
+        table->get(0).worldname = name;
     }
 
     bool change_cash(int amount) {
-        auto& player = Engine.db()->get_table<Entity>("player")->get(0);
+        auto& player = table->get(0);
         if (player.cash + amount < 0) {
             return false;
         }
@@ -38,8 +38,11 @@ class Player {
     }
 
     int current_cash() {
-        return Engine.db()->get_table<Entity>("player")->get(0).cash;
+        return table->read(0).cash;
     }
+
+    private:
+    Table<Entity>* table;
 };
 
 #endif
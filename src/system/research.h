@@ -26,7 +26,7 @@ class Research {
     std::vector<Research::Info> itemlist() {
         std::vector<Research::Info> ret;
         auto table = Engine.db()->get_table<Entity>("research");
-        for (auto& item : *table) {
+        for (auto& item : table->read_rows()) {
             int prog =  100 * (double)item.current_progress / item.max_progress;
             ret.emplace_back(item.name.toStdString(), item.description.toStdString(), prog);
         }
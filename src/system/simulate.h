@@ -43,7 +43,7 @@ class Simulate : public Scene {
         }
         if (approach(current_town, 10)) {
             Engine.audio()->play_sound("menu2");
-            for (auto& building : Engine.db()->get_table<Buildings::Town>("towns")->get(current_town).buildings) {
+            for (auto& building : Engine.db()->get_table<Buildings::Town>("towns")->read(current_town).buildings) {
                 if (building.x < 0 || building.y < 0) {
                     break;
                 }
@@ -183,6 +183,7 @@ HUD::HUD(Size s): Composite(s) {
         return 0.0;
     }}); 
     m_texture = new BoxTexture(s, {0, 0, 170}, {0, 0, 32}, {200, 200, 200});
+    set_layered(true);
 }
 
 void HUD::change_layout(const std::vector<std::pair<Composite*, Point>>& new_layout, bool back) {
@@ -192,6 +193,7 @@ void HUD::change_layout(const std::vector<std::pair<Composite*, Point>>& new_lay
         }
     }
     children.clear();
+    set_update(true);
     Point start = {0, 0};
     if (back) {
         add_child(new BackButton(this, {0.8 * size.w, 0.06 * size.h}), {0.1 * size.w, 0.01 * size.h});
@@ -9,6 +9,7 @@ class HUD : public Composite {
     public:
         HUD(Size s);
         void init();
+        const char* profile_name() { return "HUD"; }
         void change_layout(const std::vector<std::pair<Composite*, Point>>& new_layout, bool back=true);
         std::vector<std::pair<Composite*, Point>> create_standard_layout();
     private:
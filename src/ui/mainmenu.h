@@ -26,6 +26,7 @@ class MapScreen : public Composite, public Composite::Listener, public MessageBo
                 key_zoomin = cfg["keys"]["zoomin"].s();
                 key_zoomout = cfg["keys"]["zoomout"].s();
                 key_quit = cfg["keys"]["quit"].s();
+                zoom_step = cfg.contains("zoom_step") ? cfg["zoom_step"].d() : 2.0;
                 Engine.input()->add_key_listeners(this, {key_up, key_down, key_left, key_right});
                 Engine.input()->add_key_listeners(this, {key_zoomin, key_zoomout, key_quit});
             }
@@ -40,19 +41,21 @@ class MapScreen : public Composite, public Composite::Listener, public MessageBo
                 } else if (key == key_right) {
                     Engine.map()->move_cam({accel, 0});
                 } else if (key == key_zoomin) {
-                    Engine.map()->zoom_cam(2);
+                    Engine.map()->zoom_cam(zoom_step);
                 } else if (key == key_zoomout) {
-                    Engine.map()->zoom_cam(-2);
+                    Engine.map()->zoom_cam(1 / zoom_step);
                 } else if (key == key_quit) {
                     exit(0);
                 }
             }
 
             int accel = 1;
+            double zoom_step = 2.0;
             std::string key_up, key_down, key_left, key_right, key_zoomin, key_zoomout, key_quit;
     };
     public:
 
+    const char* profile_name() { return "MapScreen"; }
     MapScreen(): Composite({0, 0}) {
         Size resolution = Engine.screen()->get_size();
         double hud_width_per = 0.25;
@@ -80,6 +83,7 @@ class MapScreen : public Composite, public Composite::Listener, public MessageBo
 class MainMenu : public Composite, TextInputWidget::Listener, Composite::Listener {
   public:
     MainMenu(Size sz): Composite(sz) {}
+    const char* profile_name() { return "MainMenu"; }
     
     virtual void fade_completed(Composite*) {
         Engine.screen()->clear();
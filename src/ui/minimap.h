@@ -11,6 +11,7 @@ class MiniMap : public Composite, Input::Listener, Tilemap::Listener {
     public:
         MiniMap(Size sz): Composite(sz) {
             m_texture = new Texture((unsigned)0x00000000, sz);
+            set_layered(true);
         }
 
         void create() {
@@ -29,7 +30,10 @@ class MiniMap : public Composite, Input::Listener, Tilemap::Listener {
 
         void map_changed() { 
             recreate = true; 
+            set_update(true);
         }
+        void camera_moved() { set_update(true); }
+        void tile_clicked(Point) { set_update(true); } // towns may have been built or destroyed
         
         void draw() {
             if (recreate) {
@@ -41,13 +45,14 @@ class MiniMap : public Composite, Input::Listener, Tilemap::Listener {
                 Engine.map()->add_listener(this);
                 listener_registered = true;
             }
-            if (needs_update()) {
-                Engine.screen()->blit(m_texture->pixels(), m_texture->size(), pos, Box(pos, size), false);
+            const std::vector<Box> boxes = repaint_boxes();
+            for (auto& clip : boxes) {
+                Engine.screen()->blit(m_texture->pixels(), m_texture->size(), pos, clip, false);
                 Size tiles_per_pixel = Engine.map()->tilemap_size() / size;
                 Box corners = Engine.map()->visible_tiles();
                 Point tile_center(corners.center().x, corners.center().y, Engine.map()->tilemap_size());
                 Point mini_cam_pos = pos + Point(tile_center.x / tiles_per_pixel.w, tile_center.y / tiles_per_pixel.h);
-                Engine.screen()->blit(texture_cam->pixels(), texture_cam->size(), mini_cam_pos, Box(pos, size), true);
+                Engine.screen()->blit(texture_cam->pixels(), texture_cam->size(), mini_cam_pos, clip, true);
                 /* disabled drawing box on mini-map due to complex edge-wrapping
                 Point p1 = pos + Point(corners.a.x / tiles_per_pixel.w, corners.a.y / tiles_per_pixel.h);
                 Point p2 = pos + Point(corners.b.x / tiles_per_pixel.w, corners.b.y / tiles_per_pixel.h);
@@ -61,8 +66,10 @@ class MiniMap : public Composite, Input::Listener, Tilemap::Listener {
                 for (auto it = table->begin(); it != table->end(); ++it) {
                     Point p_town(it.key());
                     Point p_dot = pos + Point(p_town.x / tiles_per_pixel.w, p_town.y / tiles_per_pixel.h);
-                    Engine.screen()->blit(texture_city->pixels(), texture_city->size(), p_dot, Box(pos, size), false);
+                    Engine.screen()->blit(texture_city->pixels(), texture_city->size(), p_dot, clip, false);
                 }
+            }
+            if (!boxes.empty()) {
                 set_update(false);
             }
         }
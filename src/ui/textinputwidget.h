@@ -35,9 +35,7 @@ class TextInputWidget : public BasicBox {
             TextInputWidget* parent = nullptr;
     };
    
-   TextInputWidget(Size sz, const std::string& text, TextInputWidget::Listener* l = nullptr): BasicBox(sz), title(text), listener(l) {
-        MAX_NO_UPDATES = 1;       
-   }
+   TextInputWidget(Size sz, const std::string& text, TextInputWidget::Listener* l = nullptr): BasicBox(sz), title(text), listener(l) {}
 
     virtual ~TextInputWidget() {
         delete title_text;
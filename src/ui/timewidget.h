@@ -56,7 +56,7 @@ class SimulateButton : public BasicButton, public Composite::Listener, public Me
             } else {
                 Point current = towns.back();
                 towns.pop_back();
-                auto& town = Engine.db()->get_table<Buildings::Town>("towns")->get(current);
+                auto& town = Engine.db()->get_table<Buildings::Town>("towns")->read(current);
                 Size s = Engine.map()->get_size();
                 std::string text = "This is the town of " + town.name.toStdString() + "!";
                 auto messagebox = new MessageBox({1.0 * s.w, 0.35 * s.h}, text, this);